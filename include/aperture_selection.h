@@ -0,0 +1,38 @@
+#ifndef APERTURE_SELECTION_H
+
+#define APERTURE_SELECTION_H
+
+#include <string>
+#include <vector>
+
+#include "stitch_plan.h"
+
+/* Apertures to keep, as any combination of an index list ("0,5,10-20"), a
+ * file of OBJ_IDs one per line, and a cfitsio row filter on the CATALOGUE
+ * (e.g. "FLUX_MEAN > 1000 && FLUX_MEAN < 5000"). An aperture is kept if it
+ * satisfies every criterion given. With `nshards` set, the kept apertures
+ * are split into that many contiguous ranges and only range `shard` is
+ * kept. */
+struct ApertureSelection {
+    std::string indices;
+    std::string ids_file;
+    std::string filter;
+    int shard, nshards;
+
+    ApertureSelection() : shard(0), nshards(0) {}
+
+    bool empty() const {
+        return indices.empty() && ids_file.empty() && filter.empty() &&
+               (nshards == 0);
+    }
+};
+
+/* Parse a shard given as "i/N" */
+void parse_shard(const std::string &spec, ApertureSelection &selection);
+
+/* Sorted source aperture indices matching `selection`, resolved against the
+ * CATALOGUE of `source` */
+std::vector<long> select_apertures(const ApertureSelection &selection,
+                                   const SourceFile &source);
+
+#endif /* end of include guard: APERTURE_SELECTION_H */
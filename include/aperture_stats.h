@@ -0,0 +1,149 @@
+#ifndef APERTURE_STATS_H
+
+#define APERTURE_STATS_H
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "fits_file.h"
+
+/* Count, sum and sum of squares of the finite values seen. Sums are taken
+ * about `shift`, the first finite value, so that the variance of bright
+ * apertures with little scatter does not cancel away. */
+struct Moments {
+    Moments()
+        : count(0), shift(NAN), sum(0), sumsq(0),
+          min(std::numeric_limits<double>::infinity()),
+          max(-std::numeric_limits<double>::infinity()) {}
+
+    double mean() const;
+    /* Scatter about the mean, normalised by the count as numpy.std is */
+    double rms() const;
+
+    double count, shift, sum, sumsq, min, max;
+};
+
+/* Add the `n` values at `values` to `m`, skipping NaNs and infinities; an
+ * infinite shift would make every later sum NaN. `v - v == 0` only holds
+ * for finite `v`. The loop keeps independent partial results in lanes so
+ * the compiler can vectorise it without having to reorder a single
+ * floating point sum; the selects need -fno-trapping-math to be
+ * if-converted. */
+template <typename T>
+void accumulate_moments(Moments &m, const T *values, long n) {
+    enum { LANES = 8 };
+    if (std::isnan(m.shift)) {
+        for (long i = 0; i < n; i++) {
+            if (std::isfinite((double)values[i])) {
+                m.shift = values[i];
+                break;
+            }
+        }
+        if (std::isnan(m.shift)) {
+            return;
+        }
+    }
+
+    const double shift = m.shift;
+    double count[LANES], sum[LANES], sumsq[LANES], lo[LANES], hi[LANES];
+    for (int l = 0; l < LANES; l++) {
+        count[l] = sum[l] = sumsq[l] = 0;
+        lo[l] = m.min;
+        hi[l] = m.max;
+    }
+
+    long i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double v = values[i + l];
+            bool ok = v - v == 0;
+            double x = ok ? v - shift : 0;
+            count[l] += ok;
+            sum[l] += x;
+            sumsq[l] += x * x;
+            lo[l] = ok && (v < lo[l]) ? v : lo[l];
+            hi[l] = ok && (v > hi[l]) ? v : hi[l];
+        }
+    }
+    for (; i < n; i++) {
+        double v = values[i];
+        bool ok = v - v == 0;
+        double x = ok ? v - shift : 0;
+        count[0] += ok;
+        sum[0] += x;
+        sumsq[0] += x * x;
+        lo[0] = ok && (v < lo[0]) ? v : lo[0];
+        hi[0] = ok && (v > hi[0]) ? v : hi[0];
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        m.count += count[l];
+        m.sum += sum[l];
+        m.sumsq += sumsq[l];
+        m.min = std::min(m.min, lo[l]);
+        m.max = std::max(m.max, hi[l]);
+    }
+}
+
+/* Streaming estimate of the p quantile with the P-squared algorithm of Jain
+ * & Chlamtac (1985): five markers whose heights follow the minimum, p/2, p,
+ * (1+p)/2 quantiles and maximum, adjusted by piecewise parabolic
+ * interpolation as values arrive. Constant memory, no values are kept. */
+struct P2Quantile {
+    P2Quantile() : count(0) {}
+
+    void add(double x, double p);
+    double value(double p) const;
+
+    double q[5], n[5];
+    long count;
+};
+
+/* Per-aperture statistics of one image, fed with the tiles written to the
+ * output. Rows match the output CATALOGUE. */
+struct ApertureStats {
+    ApertureStats() {}
+    explicit ApertureStats(long napertures);
+
+    /* `pixels` holds block.napertures rows of block.nimages values, the
+     * first being output aperture `out_aperture` */
+    template <typename T>
+    void add(const T *pixels, long out_aperture, const ImageDimensions &block) {
+        for (long a = 0; a < block.napertures; a++) {
+            const T *row = pixels + a * block.nimages;
+            long ap = out_aperture + a;
+            accumulate_moments(moments[ap], row, block.nimages);
+
+            P2Quantile *estimates = &quantiles[ap * nquantiles];
+            for (long i = 0; i < block.nimages; i++) {
+                double v = row[i];
+                if (!std::isfinite(v)) {
+                    continue;
+                }
+                for (int k = 0; k < nquantiles; k++) {
+                    estimates[k].add(v, quantile_levels[k]);
+                }
+            }
+        }
+    }
+
+    enum { nquantiles = 3 };
+    static const double quantile_levels[nquantiles];
+    static const char *quantile_names[nquantiles];
+
+    std::vector<Moments> moments;
+    std::vector<P2Quantile> quantiles;
+};
+
+/* Append a STATS table to `out` with one row per aperture and, for each
+ * image, its COUNT, MEAN, RMS, MIN, MAX and quantile columns prefixed with
+ * the image name, e.g. FLUX_MEDIAN */
+void write_stats_table(FITSFile *out,
+                       const std::map<std::string, ApertureStats> &stats,
+                       long napertures);
+
+#endif /* end of include guard: APERTURE_STATS_H */
@@ -0,0 +1,19 @@
+#ifndef BINNED_OUTPUT_H
+
+#define BINNED_OUTPUT_H
+
+#include <string>
+
+#include "stitch_options.h"
+#include "stitch_plan.h"
+
+/* Write the planned epochs averaged into bins of options.bin_minutes on a
+ * grid starting at MJD 0. Bins never span two source files. FLUX is the
+ * inverse variance weighted mean using FLUXERR, FLUXERR the propagated
+ * error and NPOINTS the number of frames used per aperture; other images
+ * are plain means. IMAGELIST holds the mean of each numeric column and the
+ * NFRAMES in each bin. NaNs are skipped throughout. */
+void write_binned(const StitchPlan &plan, const std::string &output,
+                  const StitchOptions &options);
+
+#endif /* end of include guard: BINNED_OUTPUT_H */
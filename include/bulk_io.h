@@ -0,0 +1,48 @@
+#ifndef BULK_IO_H
+
+#define BULK_IO_H
+
+#include <string>
+#include <sys/types.h>
+
+/* Copies byte ranges between open files with positioned reads and writes,
+ * bypassing cfitsio's record buffers. Ranges queued with copy() are merged
+ * while they continue the previous one in both files, then moved through
+ * `buffer` in pieces of size / depth bytes, one per slot. Backends with
+ * asynchronous I/O keep up to `depth` pieces in flight. finish() returns
+ * once everything queued has been written. */
+struct BulkCopier {
+    BulkCopier(char *buffer, long size, int depth);
+    virtual ~BulkCopier() {}
+
+    void copy(int in, off_t in_offset, int out, off_t out_offset,
+              long nbytes);
+    void finish();
+
+    struct Range {
+        int in, out;
+        off_t in_offset, out_offset;
+        long nbytes;
+    };
+
+    /* Copy `piece`, at most slot_bytes long, through slot `slot` */
+    virtual void transfer(const Range &piece, int slot) = 0;
+    /* Wait for a slot to be free and return it */
+    virtual int freeSlot() = 0;
+    /* Wait for every transfer in flight */
+    virtual void drain() = 0;
+
+    void flush();
+
+    char *buffer;
+    long slot_bytes;
+    int depth;
+    Range pending;
+};
+
+/* Names of the backends, "pread" and, when built with liburing, "uring" */
+bool bulk_backend_available(const std::string &backend);
+BulkCopier *create_bulk_copier(const std::string &backend, char *buffer,
+                               long size, int depth);
+
+#endif /* end of include guard: BULK_IO_H */
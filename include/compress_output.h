@@ -0,0 +1,14 @@
+#ifndef COMPRESS_OUTPUT_H
+
+#define COMPRESS_OUTPUT_H
+
+#include <string>
+
+#include "stitch_options.h"
+
+/* Copy a stitched file, writing every image HDU as a tile-compressed image
+ * with one aperture per tile */
+void compress_file(const std::string &input, const std::string &output,
+                   const StitchOptions &options);
+
+#endif /* end of include guard: COMPRESS_OUTPUT_H */
@@ -0,0 +1,52 @@
+#ifndef COPY_PIPELINE_H
+
+#define COPY_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/* Fixed set of image buffers of `size` bytes shared between the reader
+ * threads and the writer. Readers block in acquire() until the writer has
+ * released a buffer, which bounds the total memory in flight. After
+ * abort(), acquire() throws instead so readers stop when the copy fails. */
+struct BufferPool {
+    BufferPool(int nbuffers, long size);
+
+    std::vector<char> *acquire();
+    void release(std::vector<char> *buffer);
+    void abort();
+
+    std::deque<std::vector<char>> buffers;
+    std::vector<std::vector<char> *> available;
+    bool aborted;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+/* Tasks that touch the output file, executed in order by the single thread
+ * that calls run(). When not threaded, tasks run immediately on the caller.
+ * A task that throws in run() is recorded in `error`, the first such error
+ * is passed to `on_error`, and the remaining tasks are skipped. */
+struct WriteQueue {
+    explicit WriteQueue(bool threaded);
+
+    void push(std::function<void()> task);
+
+    void addProducer();
+    void removeProducer();
+    void run();
+
+    bool threaded;
+    int producers;
+    std::exception_ptr error;
+    std::function<void()> on_error;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+#endif /* end of include guard: COPY_PIPELINE_H */
@@ -0,0 +1,48 @@
+#ifndef EPOCH_INDEX_H
+
+#define EPOCH_INDEX_H
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "fits_file.h"
+
+/* One row of the INDEX table of a stitched file: the output epochs
+ * [start, stop) holding a source file (type FILE) or a night (type NIGHT).
+ * Files merged by TMID with overlapping files share their range, in which
+ * case nrows is less than stop - start. */
+struct IndexEntry {
+    std::string type;
+    std::string name;
+    long start, stop, nrows;
+    MJDRange mjd;
+};
+
+/* Split the output TMIDs into nights wherever consecutive epochs are more
+ * than `gap` days apart. Nights are named by the UTC date at noon before
+ * their first epoch, i.e. the date the night starts on in Chile. */
+std::vector<IndexEntry> night_entries(const std::vector<double> &tmid,
+                                      double gap);
+
+/* Move `entry` from source rows to output rows through `segments`, taking
+ * the MJD bounds from `tmid`. Returns false if none of its rows are
+ * copied. */
+bool map_entry(const std::vector<Segment> &segments,
+               const std::vector<double> &tmid, IndexEntry &entry);
+
+void write_index_table(FITSFile *out, const std::vector<IndexEntry> &entries);
+std::vector<IndexEntry> read_index(FITSFile &f);
+/* The entry called `name`; FILE entries also match on their basename */
+const IndexEntry &find_index_entry(const std::vector<IndexEntry> &entries,
+                                   const std::string &name);
+
+/* Print the INDEX table of `filename` */
+void print_index(const std::string &filename);
+/* Write the epochs of entry `name` of `input` to a new file with the same
+ * HDUs: each image cut to those epochs, the matching IMAGELIST rows and the
+ * CATALOGUE as is */
+void extract_slice(const std::string &input, const std::string &name,
+                   const std::string &output, long max_bytes);
+
+#endif /* end of include guard: EPOCH_INDEX_H */
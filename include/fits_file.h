@@ -3,17 +3,35 @@
 #define FITS_FILE_H
 
 #include <fitsio.h>
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <map>
+#include <stdexcept>
 #include <vector>
 
 #include "util.h"
 
+/* A failed cfitsio call: the status code along with the file, the 0-based
+ * HDU index and, for column operations, the column it was working on */
+struct FitsError : public std::runtime_error {
+    FitsError(int status, const std::string &filename, int hdu,
+              const std::string &context, const std::string &message);
+
+    int status;
+    std::string filename;
+    int hdu;
+    std::string context;
+};
+
 struct FITSFile {
     fitsfile *fptr;
     int status;
     std::string filename;
 
+    /* Number of files opened or created, reported at the end of a run */
+    static std::atomic<long> nopened;
+
     FITSFile(fitsfile *fptr, int status) : fptr(fptr), status(status) {}
     FITSFile(fitsfile *fptr) : FITSFile(fptr, 0) {}
     FITSFile() : FITSFile(NULL) {}
@@ -21,57 +39,144 @@ struct FITSFile {
     static FITSFile *createFile(const std::string &filename);
 
     FITSFile(const std::string &filename);
-    ~FITSFile() { close(); }
+    ~FITSFile();
 
     ImageDimensions imageDimensions();
-    MJDRange mjd_range();
+    std::vector<double> tmid();
     int colnum(const std::string &name);
+    double readKey(const std::string &name, double default_value);
     long nimages();
 
-    std::vector<double> readWholeImage();
-    void writeImageSubset(const std::vector<double> &data, long start_image,
-                          const ImageDimensions &dim);
+    /* Read/write a rectangular block of `tile` pixels whose first pixel is
+     * at (start_image, start_aperture). `data` must hold at least
+     * tile.nimages * tile.napertures values. */
+    template <typename T>
+    void readImageTile(T *data, long start_image, long start_aperture,
+                       const ImageDimensions &tile);
+    template <typename T>
+    void writeImageTile(const T *data, long start_image, long start_aperture,
+                        const ImageDimensions &tile);
 
     std::vector<std::pair<std::string, ColumnDefinition>> column_description();
 
-    void addImage(const std::string &name, long nimages, long napertures);
-    void addImage(const std::string &name, const ImageDimensions &dim) {
-        addImage(name, dim.nimages, dim.napertures);
+    void addImage(const std::string &name, long nimages, long napertures,
+                  int image_type = DOUBLE_IMG);
+    void addImage(const std::string &name, const ImageDimensions &dim,
+                  int image_type = DOUBLE_IMG) {
+        addImage(name, dim.nimages, dim.napertures, image_type);
     };
+    /* Columns are created in `order` if given, otherwise by name */
     void addBinaryTable(
         const std::string &name,
         const std::map<std::string, ColumnDefinition> &column_description,
-        long nrows);
+        long nrows,
+        const std::vector<std::string> &order = std::vector<std::string>());
+    /* Bytes per row of the current table HDU */
+    long rowBytes();
 
     void toHDU(const std::string &name);
     void toHDU(int index);
+    int hduIndex();
     void close();
-    void check();
+    /* Throw a FitsError if the last cfitsio call failed */
+    void check(const std::string &context = "");
+    void checkColumn(int colnum);
 };
 
+/* cfitsio datatype code of the C type T */
+template <typename T> struct FitsDatatype;
+template <> struct FitsDatatype<unsigned char> { enum { value = TBYTE }; };
+template <> struct FitsDatatype<signed char> { enum { value = TSBYTE }; };
+template <> struct FitsDatatype<short> { enum { value = TSHORT }; };
+template <> struct FitsDatatype<unsigned short> { enum { value = TUSHORT }; };
+template <> struct FitsDatatype<int> { enum { value = TINT }; };
+template <> struct FitsDatatype<unsigned int> { enum { value = TUINT }; };
+template <> struct FitsDatatype<long long> { enum { value = TLONGLONG }; };
+template <> struct FitsDatatype<float> { enum { value = TFLOAT }; };
+template <> struct FitsDatatype<double> { enum { value = TDOUBLE }; };
+
+/* Bytes per pixel of an image created with fits_create_img(image_type) */
+size_t imagePixelSize(int image_type);
+
 template <typename T>
 std::vector<T> readColumn(FITSFile &f, long nrows, int colnum);
 
 template <typename T>
-void writeColumn(FITSFile *f, std::vector<T> &data, long start, int colnum);
+void writeColumn(FITSFile *f, T *data, long nelements, long start, int colnum);
 
+/* The addTo*Column functions copy `nrows` rows of a source column into the
+ * output rows given by `segments` */
 template <typename T>
-void addToColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
-                 int source_colnum, int dest_colnum) {
+void addToColumn(FITSFile &source, FITSFile *dest, long nrows,
+                 const std::vector<Segment> &segments, int source_colnum,
+                 int dest_colnum) {
     std::vector<T> data = readColumn<T>(source, nrows, source_colnum);
     if (source.status == COL_NOT_FOUND) {
         source.status = 0;
         fits_clear_errmsg();
     } else {
-        source.check();
-        writeColumn<T>(dest, data, start, dest_colnum);
+        source.checkColumn(source_colnum);
+        for (auto &segment : segments) {
+            writeColumn<T>(dest, &data[segment.source_start], segment.count,
+                           segment.output_start, dest_colnum);
+        }
+    }
+}
+
+void addToBoolColumn(FITSFile &source, FITSFile *dest, long nrows,
+                     const std::vector<Segment> &segments, int source_colnum,
+                     int dest_colnum);
+
+/* One contiguous block holding `nrows` strings of up to `width` characters,
+ * and the row pointers cfitsio reads strings through. Reused between calls,
+ * so it only allocates when a column needs more room than any before it. */
+struct StringArena {
+    char **reserve(long nrows, long width);
+
+    std::vector<char> data;
+    std::vector<char *> rows;
+};
+
+/* `nrows` values of a column as strings, numeric columns formatted with
+ * their display format, with surrounding blanks removed */
+std::vector<std::string> readStringColumn(FITSFile &f, long nrows,
+                                          int colnum);
+
+void addToStringColumn(FITSFile &source, FITSFile *dest, long nrows,
+                       const std::vector<Segment> &segments, int source_colnum,
+                       int dest_colnum, StringArena &arena);
+
+/* Copy `nrows` rows of each of `columns` from the table `source` is
+ * positioned on into the one `dest` is positioned on, through `segments`,
+ * converting to the column types given. Columns missing from the source
+ * are skipped. */
+void copyColumns(FITSFile &source, FITSFile *dest,
+                 const std::map<std::string, ColumnDefinition> &columns,
+                 long nrows, const std::vector<Segment> &segments,
+                 StringArena &arena);
+
+/* Copy every aperture row of the image `in` is positioned on into the image
+ * `out` is positioned on, starting at output aperture `out_aperture`, in
+ * blocks of at most `max_bytes` converted through T. Each row is read from
+ * epoch `in_image` onwards. */
+template <typename T>
+void copyImageRows(FITSFile &in, FITSFile *out, const ImageDimensions &dim,
+                   long out_aperture, long max_bytes, long in_image = 0) {
+    long rows = max_bytes / (long)sizeof(T) / dim.nimages;
+    rows = std::max(1L, std::min(dim.napertures, rows));
+    std::vector<T> buffer(rows * dim.nimages);
+    for (long ap = 0; ap < dim.napertures; ap += rows) {
+        ImageDimensions block = {dim.nimages,
+                                 std::min(rows, dim.napertures - ap)};
+        in.readImageTile(&buffer[0], in_image, ap, block);
+        out->writeImageTile(&buffer[0], 0, out_aperture + ap, block);
     }
 }
 
-void addToBoolColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
-                     int source_colnum, int dest_colnum);
-void addToStringColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
-                       int source_colnum, int dest_colnum,
-                       const ColumnDefinition &defs);
+/* Copy the rows given by `segments` as raw bytes, in blocks of at most
+ * `max_bytes`. Both tables must have identical column layouts; a FitsError
+ * is thrown if their row sizes differ. */
+void copyTableRows(FITSFile &source, FITSFile *dest,
+                   const std::vector<Segment> &segments, long max_bytes);
 
 #endif /* end of include guard: FITS_FILE_H */
@@ -3,35 +3,116 @@
 #define FITS_UPDATER_H
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <set>
 #include <vector>
 
 #include "util.h"
+#include "stitch_options.h"
+#include "stitch_plan.h"
+#include "fits_file.h"
+#include "aperture_stats.h"
 
-struct FITSFile;
+struct BufferPool;
+struct WriteQueue;
+struct MappedFile;
 
 struct FitsUpdater {
-    FitsUpdater(
-        const ImageDimensions &dim,
-        const std::map<std::string, ColumnDefinition> &imagelist_columns,
-        const std::map<std::string, ColumnDefinition> &catalogue_columns,
-        const std::set<std::string> image_names);
+    FitsUpdater(const StitchPlan &plan,
+                const StitchOptions &options = StitchOptions());
     ~FitsUpdater();
 
-    void updateImagelist(FITSFile &f);
-    void updateImage(FITSFile &f, const std::string &image);
-    void updateImages(FITSFile &f);
-    void updateCatalogue(FITSFile &f);
-    void render(const std::vector<std::string> &files,
+    void allocateOutput(const std::string &output);
+    void allocateEpochMajor(const std::string &output,
+                            const std::string &main_output);
+    void copyColumns(FITSFile &f,
+                     const std::map<std::string, ColumnDefinition> &columns,
+                     long nrows, const std::vector<Segment> &rows);
+    void updateImagelist(FITSFile &f, const SourceFile &source);
+    bool sameImagelistLayout(const SourceFile &source);
+    void updateImage(FITSFile &f, const std::string &image,
+                     const std::vector<Segment> &segments,
+                     const std::vector<Segment> &apertures);
+    void updateGroupImage(std::vector<std::shared_ptr<FITSFile> > &files,
+                          const std::vector<const SourceFile *> &group,
+                          const std::string &image, std::vector<char> &scratch);
+    void fillMissing(const std::string &image, const SourceFile &source,
+                     const std::vector<Segment> &segments);
+    template <typename T>
+    void copyImageTile(FITSFile &f, const std::string &image, long image_index,
+                       long aperture, long out_image, long out_aperture,
+                       const ImageDimensions &block);
+    template <typename T>
+    void queueTile(std::vector<char> *buffer, const std::string &image,
+                   long out_image, long out_aperture,
+                   const ImageDimensions &block);
+    template <typename T>
+    void assembleImageTiles(std::vector<std::shared_ptr<FITSFile> > &files,
+                            const std::vector<const SourceFile *> &group,
+                            const std::string &image,
+                            std::vector<char> &scratch);
+    template <typename T>
+    void copyImageTiles(FITSFile &f, const std::string &image,
+                        const std::vector<Segment> &segments,
+                        const std::vector<Segment> &apertures);
+    void updateImages(FITSFile &f, const SourceFile &source);
+    void updateCatalogue(FITSFile &f, const SourceFile &source);
+    void setupRawCopy(const std::vector<SourceFile> &sources,
+                      const std::string &output);
+    void rawCopyImage(const MappedFile &source_map, const ImageHDU &hdu,
+                      const std::string &image,
+                      const std::vector<Segment> &segments,
+                      const std::vector<Segment> &apertures);
+    void copySource(const SourceFile &source);
+    void queueTables(std::shared_ptr<FITSFile> f, const SourceFile &source);
+    void copyGroup(const std::vector<const SourceFile *> &group);
+    void writeIndex(const std::vector<SourceFile> &sources);
+    long long expectedImageBytes(const std::vector<SourceFile> &sources);
+    void render(const std::vector<SourceFile> &sources,
                 const std::string &output);
 
     FITSFile *outfile;
     ImageDimensions dimensions;
     std::map<std::string, ColumnDefinition> imagelist_columns;
     std::map<std::string, ColumnDefinition> catalogue_columns;
+    std::vector<std::string> imagelist_order;
     std::set<std::string> image_names;
-    int currentImage;
+    std::map<std::string, int> image_types;
+    StitchOptions options;
+
+    /* HDU indices of the pre-allocated output */
+    int catalogue_hdu, imagelist_hdu;
+    std::map<std::string, int> image_hdus;
+
+    /* Image tiles are read into buffers from `pool` and written to the
+     * output by tasks on `writer`; the pool holds at most
+     * options.max_buffer_bytes regardless of the input sizes */
+    BufferPool *pool;
+    WriteQueue *writer;
+    long tile_bytes;
+
+    /* Optional epoch-major companion file and its image HDU indices. Tiles
+     * are transposed into `transpose_buffer` on the writer thread. */
+    FITSFile *epoch_major;
+    std::map<std::string, int> epoch_major_hdus;
+    std::vector<char> transpose_buffer;
+
+    /* Tile of NaNs written over apertures missing from a source */
+    std::vector<double> nan_tile;
+
+    /* Per-aperture statistics of the images in options.stats_images,
+     * updated by the reader threads under the image's lock */
+    std::map<std::string, ApertureStats> stats;
+    std::map<std::string, std::mutex> stats_locks;
+
+    /* String column buffer, only used on the writer thread */
+    StringArena string_arena;
+
+    /* Output data offsets of the image HDUs copied through `output_map` */
+    std::map<std::string, long long> raw_images;
+    MappedFile *output_map;
 };
 
 #endif /* end of include guard: FITS_UPDATER_H */
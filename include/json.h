@@ -0,0 +1,28 @@
+#ifndef JSON_H
+
+#define JSON_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Minimal JSON document, enough to read configuration such as the field
+ * mappings written by stitch_all.py. Object members keep their file order. */
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array, Object };
+
+    JsonValue() : type(Null), boolean(false), number(0) {}
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+};
+
+/* Throw std::runtime_error, with the byte offset, on malformed input */
+JsonValue parse_json(const std::string &text);
+JsonValue read_json_file(const std::string &filename);
+
+#endif /* end of include guard: JSON_H */
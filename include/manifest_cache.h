@@ -0,0 +1,34 @@
+#ifndef MANIFEST_CACHE_H
+
+#define MANIFEST_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "stitch_plan.h"
+
+/* On-disk cache of SourceFile descriptions, so that unchanged inputs do not
+ * have their headers scanned again on the next run. Entries are keyed by
+ * path and are only used while the file size and mtime, to the nanosecond,
+ * still match, as reprocessing can rewrite a file within a second. May be
+ * shared between threads; headers are scanned outside the lock. */
+struct ManifestCache {
+    struct Entry {
+        long long size, mtime, mtime_ns;
+        SourceFile source;
+    };
+
+    explicit ManifestCache(const std::string &filename);
+
+    /* Sets `*hit` to whether the cached description was used */
+    SourceFile describe(const std::string &filename, bool *hit = NULL);
+    void save();
+
+    std::string filename;
+    std::map<std::string, Entry> entries;
+    long hits, misses;
+    std::mutex mutex;
+};
+
+#endif /* end of include guard: MANIFEST_CACHE_H */
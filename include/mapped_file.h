@@ -0,0 +1,23 @@
+#ifndef MAPPED_FILE_H
+
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+/* Memory map of a whole file. Writable maps are extended to at least `size`
+ * bytes first, so that every mapped page is backed by the file. Without
+ * `map` the file is only opened, for positioned I/O on `fd`, and `data` is
+ * NULL. */
+struct MappedFile {
+    MappedFile(const std::string &filename, bool writable, size_t size = 0,
+               bool map = true);
+    ~MappedFile();
+
+    std::string filename;
+    char *data;
+    size_t size;
+    int fd;
+};
+
+#endif /* end of include guard: MAPPED_FILE_H */
@@ -0,0 +1,17 @@
+#ifndef MERGE_SHARDS_H
+
+#define MERGE_SHARDS_H
+
+#include <string>
+#include <vector>
+
+#include "stitch_options.h"
+
+/* Assemble the outputs of `--shard i/N` runs into one stitched file. The
+ * shards hold consecutive aperture ranges of the same epochs, so CATALOGUE,
+ * STATS and image aperture rows are concatenated in shard order and the
+ * IMAGELIST is taken from the first shard. */
+void merge_shards(const std::vector<std::string> &shards,
+                  const std::string &output, const StitchOptions &options);
+
+#endif /* end of include guard: MERGE_SHARDS_H */
@@ -0,0 +1,66 @@
+#ifndef RUN_METRICS_H
+
+#define RUN_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct PhaseStats {
+    double seconds;
+    long calls;
+
+    PhaseStats() : seconds(0), calls(0) {}
+};
+
+/* Counters for the whole run, updated from any thread. Byte and pixel
+ * counts cover image data; rows are IMAGELIST rows. */
+struct RunMetrics {
+    RunMetrics();
+
+    void addPhase(const std::string &name, double seconds);
+    double phaseSeconds(const std::string &name);
+    /* `status` is the exit status of the run and `error` why it failed,
+     * if it did */
+    std::string json(int status = 0, const std::string &error = "");
+    void writeJSON(const std::string &filename, int status = 0,
+                   const std::string &error = "");
+
+    std::atomic<long long> bytes_read, bytes_written;
+    std::atomic<long long> pixels_copied, rows_copied;
+
+    /* cfitsio calls made through FITSFile, counted by FITSFile::check */
+    std::atomic<long long> fits_calls;
+
+    /* Image bytes the current render will write, for progress reports */
+    std::atomic<long long> bytes_expected;
+
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::map<std::string, PhaseStats> phases;
+};
+
+extern RunMetrics metrics;
+
+/* Peak resident set size of this process in kilobytes */
+long peak_rss_kb();
+
+/* Prints a throughput and ETA line to stderr every second while in scope,
+ * based on metrics.bytes_written against metrics.bytes_expected */
+struct ProgressReporter {
+    explicit ProgressReporter(bool enabled);
+    ~ProgressReporter();
+
+    bool enabled;
+    std::atomic<bool> done;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+#endif /* end of include guard: RUN_METRICS_H */
@@ -0,0 +1,86 @@
+#ifndef STITCH_OPTIONS_H
+
+#define STITCH_OPTIONS_H
+
+#include <string>
+#include <vector>
+
+#include "aperture_selection.h"
+
+struct StitchOptions {
+    /* Upper bound on the size of the buffer used to copy image data */
+    long max_buffer_bytes;
+
+    /* Number of threads reading source files */
+    int threads;
+
+    /* Image buffers each reader may fill ahead of the writer. With more
+     * than one, reads of the next tiles overlap writes of the previous. */
+    int prefetch_buffers;
+
+    /* Path of the manifest cache of source file headers, if any */
+    std::string manifest_cache;
+
+    /* How uncompressed images with matching pixel layout are copied:
+     * "mmap" maps the source and output files, "pread" and "uring" (when
+     * built with liburing) move large byte ranges with positioned I/O, up
+     * to io_depth at a time with uring. "cfitsio" copies everything
+     * through cfitsio. */
+    std::string io_backend;
+    int io_depth;
+
+    /* Tile compression algorithm for output images (cfitsio code, 0 for
+     * none) and the quantisation level for floating point images (0 is
+     * lossless) */
+    int compression;
+    float quantize_level;
+
+    /* Companion file holding every image transposed, with epochs as rows,
+     * for fast reads of one epoch across all apertures */
+    std::string epoch_major_output;
+
+    /* Only copy epochs with TMID inside this range */
+    MJDRange window;
+
+    /* Only copy epochs whose IMAGELIST row passes this cfitsio row filter,
+     * e.g. "CLOUDS < 0.75 && SHIFT <= 3"; empty copies all */
+    std::string frame_filter;
+
+    /* Average epochs into bins of this many minutes rather than copying
+     * them; 0 copies every epoch */
+    double bin_minutes;
+
+    /* Only copy these apertures; empty copies all */
+    ApertureSelection apertures;
+
+    /* Match apertures across files by this CATALOGUE column rather than by
+     * row, keeping the "union" or "intersection" of them; empty requires
+     * every file to have the same apertures */
+    std::string aperture_match;
+    std::string aperture_key;
+
+    /* Images to compute per-aperture statistics of into a STATS table */
+    std::vector<std::string> stats_images;
+
+    /* Epochs further apart than this many days start a new night in the
+     * INDEX table */
+    double night_gap;
+
+    /* Print a live throughput and ETA line while copying images */
+    bool progress;
+
+    /* Other stitches run at the same time in this process, so the run
+     * metrics and file counts cover them too and are only reported for the
+     * process as a whole */
+    bool shared_metrics;
+
+    StitchOptions()
+        : max_buffer_bytes(256L * 1024L * 1024L), threads(1),
+          prefetch_buffers(2), io_backend("mmap"), io_depth(4),
+          compression(0),
+          quantize_level(0), window(all_mjds()), bin_minutes(0),
+          aperture_key("OBJ_ID"), night_gap(0.25), progress(false),
+          shared_metrics(false) {}
+};
+
+#endif /* end of include guard: STITCH_OPTIONS_H */
@@ -0,0 +1,104 @@
+#ifndef STITCH_PLAN_H
+
+#define STITCH_PLAN_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+/* Layout of one image HDU of a source file */
+struct ImageHDU {
+    int index;
+    int bitpix;
+    double bscale, bzero;
+    bool compressed;
+    ImageDimensions dimensions;
+    /* Byte offset of the data unit in the file */
+    long long datastart;
+};
+
+/* Everything the stitcher needs to know about one input file, gathered in a
+ * single pass over its headers */
+struct SourceFile {
+    std::string filename;
+    ImageDimensions dimensions;
+    long nimages;
+    MJDRange mjd;
+    /* IMAGELIST rows are already in TMID order */
+    bool sorted;
+
+    /* HDU indices, as used by FITSFile::toHDU(int). index_hdu is -1 unless
+     * the file is itself a stitched output with an INDEX table. */
+    int catalogue_hdu, imagelist_hdu, index_hdu;
+    std::map<std::string, ImageHDU> image_hdus;
+
+    std::map<std::string, ColumnDefinition> imagelist_columns;
+    std::map<std::string, ColumnDefinition> catalogue_columns;
+    /* IMAGELIST column names in the order they appear in the file */
+    std::vector<std::string> imagelist_order;
+
+    /* Where this file's rows go in the output. Filled in by build_plan and
+     * not part of the cached description. */
+    std::vector<Segment> segments;
+
+    /* Source aperture rows (CATALOGUE rows and image rows) copied to the
+     * output, as runs of consecutive apertures, and the subset of them
+     * whose CATALOGUE rows this file supplies. Also planned, not cached. */
+    std::vector<Segment> aperture_runs;
+    std::vector<Segment> catalogue_runs;
+};
+
+struct StitchPlan {
+    std::vector<SourceFile> sources;
+    ImageDimensions dimensions;
+    std::map<std::string, ColumnDefinition> imagelist_columns;
+    std::map<std::string, ColumnDefinition> catalogue_columns;
+    /* Output IMAGELIST column order: that of the first source, followed by
+     * any columns only later sources have. Sources sharing the output
+     * layout can then have their rows copied as raw bytes. */
+    std::vector<std::string> imagelist_order;
+    std::set<std::string> image_names;
+    /* Output pixel type (fits_create_img code) of each image */
+    std::map<std::string, int> image_types;
+};
+
+struct ManifestCache;
+
+/* Pixel type cfitsio presents an image HDU as, after applying the BZERO
+ * conventions for unsigned integers and any other scaling */
+int equivalent_image_type(const ImageHDU &hdu);
+/* BITPIX of the data unit of an image created as `image_type` */
+int storage_bitpix(int image_type);
+
+/* Window covering every TMID */
+MJDRange all_mjds();
+
+SourceFile describe_source(const std::string &filename);
+/* Only IMAGELIST rows with TMID inside `window`, and passing the cfitsio
+ * row filter `filter` if given, are planned for copying; files left with
+ * no rows are dropped */
+StitchPlan build_plan(const std::vector<std::string> &files,
+                      ManifestCache *cache = NULL,
+                      const MJDRange &window = all_mjds(),
+                      const std::string &filter = "");
+/* build_plan maps aperture i of every file to output aperture i, with the
+ * CATALOGUE from the first file. That needs every file to have the same
+ * apertures in the same order; this throws if their counts differ. */
+void check_same_apertures(const StitchPlan &plan);
+/* Only copy the given sorted source apertures, the same in every file */
+void restrict_apertures(StitchPlan &plan, const std::vector<long> &apertures);
+/* Match apertures across files by the CATALOGUE column `key` instead. The
+ * output holds the union of the keys in order of first appearance, or with
+ * `intersection` only those in every file. Each CATALOGUE row comes from
+ * the first file with its key. */
+void match_apertures(StitchPlan &plan, const std::string &key,
+                     bool intersection);
+/* Output apertures not covered by `source`, as runs whose output_start is
+ * the first such aperture */
+std::vector<Segment> missing_apertures(const SourceFile &source,
+                                       long napertures);
+
+#endif /* end of include guard: STITCH_PLAN_H */
@@ -3,9 +3,21 @@
 #define TIME_UTILS_H
 
 #include <string>
+#include <chrono>
 
 const std::string current_time();
 
 #define log std::cout << "[" << current_time() << "] "
 
+/* Adds the time spent in scope to the run metrics under `name` and, if
+ * `report` is set, logs "Phase <name> took <seconds>s" */
+struct PhaseTimer {
+    explicit PhaseTimer(const std::string &name, bool report = true);
+    ~PhaseTimer();
+
+    std::string name;
+    bool report;
+    std::chrono::steady_clock::time_point start;
+};
+
 #endif /* end of include guard: TIME_UTILS_H */
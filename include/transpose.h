@@ -0,0 +1,26 @@
+#ifndef TRANSPOSE_H
+
+#define TRANSPOSE_H
+
+#include <algorithm>
+
+/* Transpose a `rows` x `cols` row-major block of T into a `cols` x `rows`
+ * block, working in small square sub-blocks so that both the reads and the
+ * writes stay within cache lines */
+template <typename T>
+void transpose_block(const T *src, T *dst, long rows, long cols) {
+    const long block = 64;
+    for (long r0 = 0; r0 < rows; r0 += block) {
+        long r1 = std::min(rows, r0 + block);
+        for (long c0 = 0; c0 < cols; c0 += block) {
+            long c1 = std::min(cols, c0 + block);
+            for (long r = r0; r < r1; r++) {
+                for (long c = c0; c < c1; c++) {
+                    dst[c * rows + r] = src[r * cols + c];
+                }
+            }
+        }
+    }
+}
+
+#endif /* end of include guard: TRANSPOSE_H */
@@ -15,4 +15,9 @@ struct MJDRange {
     double min, max;
 };
 
+/* A run of consecutive source rows that land on consecutive output rows */
+struct Segment {
+    long source_start, output_start, count;
+};
+
 #endif /* end of include guard: UTIL_H */
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+Time per-star (light curve) and per-epoch reads of an image HDU, from the
+stitched file and from its --epoch-major companion
+'''
+
+from __future__ import division, print_function, absolute_import
+import argparse
+import logging
+import time
+import fitsio
+import numpy as np
+
+logging.basicConfig(level='INFO', format='%(levelname)7s %(message)s')
+logger = logging.getLogger(__name__)
+
+
+def time_reads(hdu, indices, read):
+    start = time.time()
+    nbytes = 0
+    for index in indices:
+        nbytes += read(hdu, index).nbytes
+    elapsed = time.time() - start
+    return elapsed / len(indices), nbytes / elapsed / 1024. ** 2
+
+
+def main(args):
+    if args.verbose:
+        logger.setLevel('DEBUG')
+    logger.debug(args)
+
+    np.random.seed(args.seed)
+    with fitsio.FITS(args.filename) as main_file, \
+            fitsio.FITS(args.epoch_major) as epoch_file:
+        stitched = main_file[args.hdu]
+        transposed = epoch_file[args.hdu]
+        napertures, nimages = stitched.get_dims()
+        logger.info('%s: %d apertures x %d epochs', args.hdu, napertures,
+                    nimages)
+
+        apertures = np.random.randint(0, napertures, args.nreads)
+        epochs = np.random.randint(0, nimages, args.nreads)
+
+        patterns = [
+            ('star', 'stitched', stitched, apertures,
+             lambda hdu, i: hdu[int(i):int(i) + 1, :]),
+            ('star', 'epoch-major', transposed, apertures,
+             lambda hdu, i: hdu[:, int(i):int(i) + 1]),
+            ('epoch', 'stitched', stitched, epochs,
+             lambda hdu, i: hdu[:, int(i):int(i) + 1]),
+            ('epoch', 'epoch-major', transposed, epochs,
+             lambda hdu, i: hdu[int(i):int(i) + 1, :]),
+        ]
+
+        print('{:>8s} {:>12s} {:>12s} {:>10s}'.format(
+            'read', 'file', 'ms/read', 'MB/s'))
+        for pattern, name, hdu, indices, read in patterns:
+            per_read, rate = time_reads(hdu, indices, read)
+            print('{:>8s} {:>12s} {:12.3f} {:10.1f}'.format(
+                pattern, name, per_read * 1000., rate))
+
+
+if __name__ == '__main__':
+    description = 'Benchmark light curve and epoch reads of a stitched file'
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument('filename', help='Stitched file')
+    parser.add_argument('epoch_major', help='Companion --epoch-major file')
+    parser.add_argument('--hdu', default='FLUX')
+    parser.add_argument('-n', '--nreads', type=int, default=100)
+    parser.add_argument('--seed', type=int, default=42)
+    parser.add_argument('-v', '--verbose', action='store_true')
+    main(parser.parse_args())
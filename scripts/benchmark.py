@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+Run zlp-stitch over a set of inputs with several strategies and report wall
+time, throughput, peak RSS, file opens and per-phase timings
+'''
+
+from __future__ import division, print_function, absolute_import
+import argparse
+import json
+import logging
+import os
+import re
+import subprocess
+import tempfile
+import time
+
+logging.basicConfig(level='INFO', format='%(levelname)7s %(message)s')
+logger = logging.getLogger(__name__)
+
+PHASE_RE = re.compile(r'Phase (\S+) took ([0-9.eE+-]+)s')
+OPENED_RE = re.compile(r'opened (\d+) files')
+
+SCENARIOS = [
+    ('default', []),
+    ('no-prefetch', ['--prefetch', '1']),
+    ('threads', ['--threads', '4']),
+    ('no-mmap', ['--no-mmap']),
+    ('pread', ['--io-backend', 'pread']),
+    ('uring', ['--io-backend', 'uring', '--io-depth', '8']),
+    ('small-buffer', ['--max-buffer-mb', '8']),
+]
+
+
+def run(binary, files, output, extra):
+    command = [binary] + files + ['-o', output] + extra
+    logger.debug(' '.join(command))
+
+    start = time.time()
+    child = subprocess.Popen(command, stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT)
+    stdout = child.stdout.read().decode('utf-8', 'replace')
+    _, status, usage = os.wait4(child.pid, 0)
+    elapsed = time.time() - start
+    if status != 0:
+        logger.error(stdout)
+        raise RuntimeError('{} exited with status {}'.format(binary, status))
+
+    phases = {}
+    for name, seconds in PHASE_RE.findall(stdout):
+        phases[name] = phases.get(name, 0.) + float(seconds)
+    opened = OPENED_RE.search(stdout)
+
+    nbytes = sum(os.path.getsize(filename) for filename in files)
+    return {
+        'wall': elapsed,
+        'mb_per_s': nbytes / elapsed / 1024. ** 2,
+        # ru_maxrss is in kilobytes on Linux
+        'peak_rss_mb': usage.ru_maxrss / 1024.,
+        'opened': int(opened.group(1)) if opened else None,
+        'phases': phases,
+    }
+
+
+def main(args):
+    if args.verbose:
+        logger.setLevel('DEBUG')
+    logger.debug(args)
+
+    scenarios = [scenario for scenario in SCENARIOS
+                 if not args.only or scenario[0] in args.only]
+    results = {}
+    output_dir = tempfile.mkdtemp(prefix='zlp-stitch-bench')
+    for name, extra in scenarios:
+        output = os.path.join(output_dir, '{}.fits'.format(name))
+        try:
+            runs = [run(args.binary, args.filename, output, extra)
+                    for _ in range(args.repeat)]
+        except RuntimeError as err:
+            # e.g. the uring backend in a build without liburing
+            logger.warning('Skipping %s: %s', name, err)
+            if os.path.exists(output):
+                os.remove(output)
+            continue
+        os.remove(output)
+        results[name] = min(runs, key=lambda result: result['wall'])
+    os.rmdir(output_dir)
+
+    print('{:>14s} {:>9s} {:>9s} {:>10s} {:>7s}  {}'.format(
+        'scenario', 'wall/s', 'MB/s', 'RSS/MB', 'opens', 'phases'))
+    for name, _ in scenarios:
+        if name not in results:
+            continue
+        result = results[name]
+        phases = ' '.join('{}={:.2f}'.format(phase, seconds)
+                          for phase, seconds in sorted(
+                              result['phases'].items()))
+        print('{:>14s} {:9.2f} {:9.1f} {:10.1f} {:>7}  {}'.format(
+            name, result['wall'], result['mb_per_s'], result['peak_rss_mb'],
+            result['opened'], phases))
+
+    if args.json:
+        with open(args.json, 'w') as outfile:
+            json.dump(results, outfile, indent=2, sort_keys=True)
+
+
+if __name__ == '__main__':
+    description = 'Benchmark zlp-stitch stitching strategies'
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument('filename', nargs='+', help='Input nightly files')
+    parser.add_argument('--binary', default='./zlp-stitch')
+    parser.add_argument('--only', nargs='+',
+                        choices=[name for name, _ in SCENARIOS])
+    parser.add_argument('--repeat', type=int, default=1,
+                        help='Runs per scenario, the fastest is reported')
+    parser.add_argument('--json', help='Also write the results as JSON')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    main(parser.parse_args())
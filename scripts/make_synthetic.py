@@ -0,0 +1,110 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+Write synthetic NGTS-shaped nightly files (CATALOGUE, IMAGELIST and
+aperture x image HDUs) for benchmarking zlp-stitch
+'''
+
+from __future__ import division, print_function, absolute_import
+import argparse
+import logging
+import os
+import fitsio
+import numpy as np
+
+logging.basicConfig(level='INFO', format='%(levelname)7s %(message)s')
+logger = logging.getLogger(__name__)
+
+# Length of one synthetic night, in days
+NIGHT_LENGTH = 0.4
+EXPOSURE_HDUS = ['HJD']
+STANDARD_HDUS = ['FLUX', 'FLUXERR', 'QUALITY', 'CCDX', 'CCDY', 'SKYBKG']
+
+
+def catalogue(napertures):
+    data = np.zeros(napertures, dtype=[
+        ('OBJ_ID', 'S26'), ('FLUX_MEAN', 'f8'), ('BLEND_FRACTION', 'f8'),
+        ('NPTS', 'i4'), ('RA', 'f8'), ('DEC', 'f8')])
+    data['OBJ_ID'] = ['NG0000-0000_{:06d}'.format(i)
+                      for i in range(napertures)]
+    data['FLUX_MEAN'] = np.random.uniform(1E2, 1E5, napertures)
+    data['RA'] = np.random.uniform(0, 360, napertures)
+    data['DEC'] = np.random.uniform(-90, 0, napertures)
+    return data
+
+
+def imagelist(night, tmid):
+    nimages = tmid.size
+    data = np.zeros(nimages, dtype=[
+        ('TMID', 'f8'), ('CLOUDS', 'f4'), ('SHIFT', 'f4'),
+        ('AIRMASS', 'f4'), ('IMAGE_ID', 'i8'), ('FILENAME', 'S40')])
+    data['TMID'] = tmid
+    data['CLOUDS'] = np.random.uniform(0, 1, nimages)
+    data['SHIFT'] = np.random.uniform(0, 2, nimages)
+    data['AIRMASS'] = np.random.uniform(1, 2, nimages)
+    data['IMAGE_ID'] = night * 100000 + np.arange(nimages)
+    data['FILENAME'] = ['IMAGE{:08d}.fits'.format(i)
+                        for i in data['IMAGE_ID']]
+    return data
+
+
+def night_times(night, nimages, overlap):
+    '''
+    Nights are spaced so consecutive ones share `overlap` of their length
+    '''
+    start = 57000. + night * NIGHT_LENGTH * (1. - overlap)
+    return np.sort(np.random.uniform(start, start + NIGHT_LENGTH, nimages))
+
+
+def write_night(filename, night, args):
+    tmid = night_times(night, args.nimages, args.overlap)
+    shape = (args.napertures, args.nimages)
+    dtype = np.dtype(args.dtype)
+
+    hdus = STANDARD_HDUS + ['EXTRA_{}'.format(i)
+                            for i in range(args.extra_hdus)]
+    with fitsio.FITS(filename, 'rw', clobber=True) as outfile:
+        outfile.write(None)
+        outfile.write(catalogue(args.napertures), extname='CATALOGUE')
+        outfile.write(imagelist(night, tmid), extname='IMAGELIST')
+        for name in EXPOSURE_HDUS:
+            hjd = np.tile(tmid, (args.napertures, 1))
+            outfile.write(hjd, extname=name)
+        for name in hdus:
+            data = np.random.normal(1E3, 10., shape).astype(dtype)
+            outfile.write(data, extname=name)
+
+
+def main(args):
+    if args.verbose:
+        logger.setLevel('DEBUG')
+    logger.debug(args)
+
+    np.random.seed(args.seed)
+    if not os.path.isdir(args.output_dir):
+        os.makedirs(args.output_dir)
+
+    for night in range(args.nfiles):
+        filename = os.path.join(args.output_dir,
+                                'night{:03d}.fits'.format(night))
+        logger.info('Writing %s', filename)
+        write_night(filename, night, args)
+
+
+if __name__ == '__main__':
+    description = 'Generate synthetic nightly files for zlp-stitch'
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument('output_dir')
+    parser.add_argument('-n', '--nfiles', type=int, default=10)
+    parser.add_argument('--nimages', type=int, default=1000)
+    parser.add_argument('--napertures', type=int, default=1000)
+    parser.add_argument('--dtype', choices=['float32', 'float64'],
+                        default='float32')
+    parser.add_argument('--overlap', type=float, default=0.,
+                        help='Fraction of each night shared with the next')
+    parser.add_argument('--extra-hdus', type=int, default=0,
+                        help='Additional aperture x image HDUs per file')
+    parser.add_argument('--seed', type=int, default=42)
+    parser.add_argument('-v', '--verbose', action='store_true')
+    main(parser.parse_args())
@@ -0,0 +1,167 @@
+#include "aperture_selection.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "fits_file.h"
+#include "time_utils.h"
+
+using namespace std;
+
+static string trim(const string &s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == string::npos) {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+/* Parse "a,b,c-d" into a flag per aperture */
+static void parse_indices(const string &indices, vector<bool> &keep) {
+    stringstream ss(indices);
+    string item;
+    while (getline(ss, item, ',')) {
+        item = trim(item);
+        if (item.empty()) {
+            continue;
+        }
+
+        long first = -1, last = -1;
+        char dash = 0;
+        stringstream range(item);
+        bool ok = bool(range >> first);
+        if (ok && (range >> dash)) {
+            ok = (dash == '-') && (range >> last);
+        } else {
+            last = first;
+        }
+        if (!ok || (first < 0) || (last < first) ||
+            (last >= (long)keep.size())) {
+            throw runtime_error("Invalid aperture range " + item);
+        }
+
+        for (long i = first; i <= last; i++) {
+            keep[i] = true;
+        }
+    }
+}
+
+static void match_ids(FITSFile &catalogue, long nrows, const string &filename,
+                      vector<bool> &keep) {
+    ifstream in(filename.c_str());
+    if (!in) {
+        throw runtime_error("Cannot read aperture id list " + filename);
+    }
+    set<string> ids;
+    string line;
+    while (getline(in, line)) {
+        line = trim(line);
+        if (!line.empty()) {
+            ids.insert(line);
+        }
+    }
+
+    int colnum = catalogue.colnum("OBJ_ID");
+    if (colnum == -1) {
+        throw runtime_error("No OBJ_ID column in " + catalogue.filename);
+    }
+    vector<string> values = readStringColumn(catalogue, nrows, colnum);
+
+    long found = 0;
+    for (long i = 0; i < nrows; i++) {
+        keep[i] = ids.count(values[i]) > 0;
+        found += keep[i];
+    }
+    if (found < (long)ids.size()) {
+        log << (ids.size() - found) << " of " << ids.size() << " OBJ_IDs in "
+             << filename << " are not in the catalogue" << endl;
+    }
+}
+
+static void match_filter(FITSFile &catalogue, long nrows, const string &filter,
+                         vector<bool> &keep) {
+    vector<char> row_status(nrows);
+    long ngood = 0;
+    fits_find_rows(catalogue.fptr, (char *)filter.c_str(), 1, nrows, &ngood,
+                   &row_status[0], &catalogue.status);
+    catalogue.check();
+    for (long i = 0; i < nrows; i++) {
+        keep[i] = row_status[i] != 0;
+    }
+}
+
+void parse_shard(const string &spec, ApertureSelection &selection) {
+    stringstream ss(spec);
+    char slash = 0;
+    int shard = -1, nshards = 0;
+    if (!(ss >> shard >> slash >> nshards) || (slash != '/') ||
+        (nshards < 1) || (shard < 0) || (shard >= nshards)) {
+        throw runtime_error("Invalid shard " + spec + ", expected i/N");
+    }
+    selection.shard = shard;
+    selection.nshards = nshards;
+}
+
+vector<long> select_apertures(const ApertureSelection &selection,
+                              const SourceFile &source) {
+    FITSFile f(source.filename);
+    f.toHDU(source.catalogue_hdu);
+    f.check();
+    long nrows = 0;
+    fits_get_num_rows(f.fptr, &nrows, &f.status);
+    f.check();
+    if (nrows == 0) {
+        throw runtime_error("No apertures to select from in the CATALOGUE "
+                            "of " + source.filename);
+    }
+
+    vector<bool> selected(nrows, true);
+    auto restrict = [&](const vector<bool> &keep) {
+        for (long i = 0; i < nrows; i++) {
+            selected[i] = selected[i] && keep[i];
+        }
+    };
+
+    if (!selection.indices.empty()) {
+        vector<bool> keep(nrows, false);
+        parse_indices(selection.indices, keep);
+        restrict(keep);
+    }
+    if (!selection.ids_file.empty()) {
+        vector<bool> keep(nrows, false);
+        match_ids(f, nrows, selection.ids_file, keep);
+        restrict(keep);
+    }
+    if (!selection.filter.empty()) {
+        vector<bool> keep(nrows, false);
+        match_filter(f, nrows, selection.filter, keep);
+        restrict(keep);
+    }
+
+    vector<long> out;
+    for (long i = 0; i < nrows; i++) {
+        if (selected[i]) {
+            out.push_back(i);
+        }
+    }
+
+    if (selection.nshards > 0) {
+        long long n = out.size();
+        long first = n * selection.shard / selection.nshards;
+        long last = n * (selection.shard + 1) / selection.nshards;
+        out = vector<long>(out.begin() + first, out.begin() + last);
+        log << "Shard " << selection.shard << "/" << selection.nshards
+             << " covers apertures " << first << " to " << last - 1 << endl;
+    }
+
+    if (out.empty()) {
+        throw runtime_error("No apertures match the selection");
+    }
+    log << "Selected " << out.size() << " of " << nrows << " apertures"
+         << endl;
+    return out;
+}
@@ -0,0 +1,162 @@
+#include "aperture_stats.h"
+#include <algorithm>
+
+using namespace std;
+
+const double ApertureStats::quantile_levels[] = {0.1, 0.5, 0.9};
+const char *ApertureStats::quantile_names[] = {"Q10", "MEDIAN", "Q90"};
+
+double Moments::mean() const {
+    return count > 0 ? shift + sum / count : NAN;
+}
+
+double Moments::rms() const {
+    if (count <= 0) {
+        return NAN;
+    }
+    double offset = sum / count;
+    return sqrt(std::max(0., sumsq / count - offset * offset));
+}
+
+void P2Quantile::add(double x, double p) {
+    /* The first five values seed the markers */
+    if (count < 5) {
+        q[count++] = x;
+        if (count == 5) {
+            sort(q, q + 5);
+            for (int i = 0; i < 5; i++) {
+                n[i] = i + 1;
+            }
+        }
+        return;
+    }
+
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x >= q[4]) {
+        q[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (x >= q[k + 1]) {
+            k++;
+        }
+    }
+    for (int i = k + 1; i < 5; i++) {
+        n[i]++;
+    }
+    count++;
+
+    /* Move the middle markers towards their desired positions */
+    const double fraction[] = {0, p / 2, p, (1 + p) / 2, 1};
+    for (int i = 1; i < 4; i++) {
+        double d = 1 + (count - 1) * fraction[i] - n[i];
+        if (!(((d >= 1) && (n[i + 1] - n[i] > 1)) ||
+              ((d <= -1) && (n[i - 1] - n[i] < -1)))) {
+            continue;
+        }
+
+        int s = d > 0 ? 1 : -1;
+        double parabolic =
+            q[i] + s / (n[i + 1] - n[i - 1]) *
+                       ((n[i] - n[i - 1] + s) * (q[i + 1] - q[i]) /
+                            (n[i + 1] - n[i]) +
+                        (n[i + 1] - n[i] - s) * (q[i] - q[i - 1]) /
+                            (n[i] - n[i - 1]));
+        if ((q[i - 1] < parabolic) && (parabolic < q[i + 1])) {
+            q[i] = parabolic;
+        } else {
+            q[i] += s * (q[i + s] - q[i]) / (n[i + s] - n[i]);
+        }
+        n[i] += s;
+    }
+}
+
+double P2Quantile::value(double p) const {
+    if (count >= 5) {
+        return q[2];
+    }
+    if (count == 0) {
+        return NAN;
+    }
+    /* Too few values for the markers, so take the quantile exactly */
+    vector<double> sorted(q, q + count);
+    sort(sorted.begin(), sorted.end());
+    return sorted[(long)(p * (count - 1) + 0.5)];
+}
+
+ApertureStats::ApertureStats(long napertures)
+    : moments(napertures), quantiles(napertures * nquantiles) {}
+
+void write_stats_table(FITSFile *out,
+                       const map<string, ApertureStats> &stats,
+                       long napertures) {
+    map<string, ColumnDefinition> columns;
+    vector<string> order;
+    auto add_column = [&](const string &name, int type) {
+        ColumnDefinition def = {1, 1, type};
+        columns[name] = def;
+        order.push_back(name);
+    };
+    for (auto &image : stats) {
+        add_column(image.first + "_COUNT", TLONG);
+        add_column(image.first + "_MEAN", TDOUBLE);
+        add_column(image.first + "_RMS", TDOUBLE);
+        add_column(image.first + "_MIN", TDOUBLE);
+        add_column(image.first + "_MAX", TDOUBLE);
+        for (int k = 0; k < ApertureStats::nquantiles; k++) {
+            add_column(image.first + "_" + ApertureStats::quantile_names[k],
+                       TDOUBLE);
+        }
+    }
+    out->addBinaryTable("STATS", columns, napertures, order);
+
+    vector<long> counts(napertures);
+    vector<double> values(napertures);
+    for (auto &image : stats) {
+        const vector<Moments> &moments = image.second.moments;
+        const string &prefix = image.first + "_";
+        for (long i = 0; i < napertures; i++) {
+            counts[i] = moments[i].count;
+        }
+        writeColumn(out, &counts[0], napertures, 0,
+                    out->colnum(prefix + "COUNT"));
+
+        for (long i = 0; i < napertures; i++) {
+            values[i] = moments[i].mean();
+        }
+        writeColumn(out, &values[0], napertures, 0,
+                    out->colnum(prefix + "MEAN"));
+        for (long i = 0; i < napertures; i++) {
+            values[i] = moments[i].rms();
+        }
+        writeColumn(out, &values[0], napertures, 0,
+                    out->colnum(prefix + "RMS"));
+
+        /* Apertures with no finite values get NaN rather than infinities */
+        for (long i = 0; i < napertures; i++) {
+            values[i] = moments[i].count > 0 ? moments[i].min : NAN;
+        }
+        writeColumn(out, &values[0], napertures, 0,
+                    out->colnum(prefix + "MIN"));
+        for (long i = 0; i < napertures; i++) {
+            values[i] = moments[i].count > 0 ? moments[i].max : NAN;
+        }
+        writeColumn(out, &values[0], napertures, 0,
+                    out->colnum(prefix + "MAX"));
+
+        for (int k = 0; k < ApertureStats::nquantiles; k++) {
+            double p = ApertureStats::quantile_levels[k];
+            for (long i = 0; i < napertures; i++) {
+                const P2Quantile &estimate =
+                    image.second.quantiles[i * ApertureStats::nquantiles + k];
+                values[i] = estimate.value(p);
+            }
+            writeColumn(out, &values[0], napertures, 0,
+                        out->colnum(prefix +
+                                    ApertureStats::quantile_names[k]));
+        }
+    }
+}
@@ -0,0 +1,476 @@
+#include "binned_output.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include "fits_file.h"
+#include "run_metrics.h"
+#include "time_utils.h"
+
+using namespace std;
+
+/* Frames of one source file falling in the same time bin. `rows` are runs
+ * of source rows; their output_start is the position within the bin. */
+struct TimeBin {
+    size_t source;
+    double tmid;
+    long nframes;
+    vector<Segment> rows;
+    long output;
+};
+
+/* Group each source's planned rows, in output order, into bins and sort the
+ * bins of all sources by mean TMID. Only TMIDs are read. */
+static vector<TimeBin> plan_bins(const StitchPlan &plan, double width) {
+    vector<TimeBin> bins;
+    for (size_t s = 0; s < plan.sources.size(); s++) {
+        const SourceFile &source = plan.sources[s];
+        FITSFile f(source.filename);
+        vector<double> tmid = f.tmid();
+
+        /* (output row, source row) */
+        vector<pair<long, long>> rows;
+        for (auto &segment : source.segments) {
+            for (long i = 0; i < segment.count; i++) {
+                rows.push_back(make_pair(segment.output_start + i,
+                                         segment.source_start + i));
+            }
+        }
+        sort(rows.begin(), rows.end());
+
+        long current = 0;
+        size_t first = bins.size();
+        for (auto &row : rows) {
+            long source_row = row.second;
+            long bin = (long)floor(tmid[source_row] / width);
+            if ((bins.size() == first) || (bin != current)) {
+                TimeBin fresh = {s, 0, 0, vector<Segment>(), -1};
+                bins.push_back(fresh);
+                current = bin;
+            }
+
+            TimeBin &last = bins.back();
+            if (!last.rows.empty() &&
+                (last.rows.back().source_start + last.rows.back().count ==
+                 source_row)) {
+                last.rows.back().count++;
+            } else {
+                Segment run = {source_row, last.nframes, 1};
+                last.rows.push_back(run);
+            }
+            last.tmid += tmid[source_row];
+            last.nframes++;
+        }
+    }
+
+    for (auto &bin : bins) {
+        bin.tmid /= bin.nframes;
+    }
+    stable_sort(bins.begin(), bins.end(),
+                [](const TimeBin &a, const TimeBin &b) {
+                    return a.tmid < b.tmid;
+                });
+    for (size_t i = 0; i < bins.size(); i++) {
+        bins[i].output = i;
+    }
+    return bins;
+}
+
+/* The binning kernels keep partial sums in independent lanes, as the
+ * statistics kernels do, so that they vectorise without reassociating */
+enum { LANES = 8 };
+
+/* Inverse variance weighted sums over `n` frames, skipping NaN fluxes and
+ * errors that are NaN, zero or negative */
+static void weighted_sums(const double *flux, const double *err, long n,
+                          double &sw, double &swf, double &count) {
+    double w_lane[LANES], wf_lane[LANES], n_lane[LANES];
+    for (int l = 0; l < LANES; l++) {
+        w_lane[l] = wf_lane[l] = n_lane[l] = 0;
+    }
+
+    long i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double f = flux[i + l], e = err[i + l];
+            double w = 1.0 / (e * e);
+            bool ok = (f == f) && (e > 0) && (w <= DBL_MAX);
+            w_lane[l] += ok ? w : 0;
+            wf_lane[l] += ok ? w * f : 0;
+            n_lane[l] += ok;
+        }
+    }
+    for (; i < n; i++) {
+        double f = flux[i], e = err[i];
+        double w = 1.0 / (e * e);
+        bool ok = (f == f) && (e > 0) && (w <= DBL_MAX);
+        w_lane[0] += ok ? w : 0;
+        wf_lane[0] += ok ? w * f : 0;
+        n_lane[0] += ok;
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        sw += w_lane[l];
+        swf += wf_lane[l];
+        count += n_lane[l];
+    }
+}
+
+/* Sum and count of the non-NaN values of `n` frames */
+static void finite_sums(const double *values, long n, double &sum,
+                        double &count) {
+    double s_lane[LANES], n_lane[LANES];
+    for (int l = 0; l < LANES; l++) {
+        s_lane[l] = n_lane[l] = 0;
+    }
+
+    long i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double v = values[i + l];
+            bool ok = v == v;
+            s_lane[l] += ok ? v : 0;
+            n_lane[l] += ok ? 1.0 : 0.0;
+        }
+    }
+    for (; i < n; i++) {
+        double v = values[i];
+        bool ok = v == v;
+        s_lane[0] += ok ? v : 0;
+        n_lane[0] += ok ? 1.0 : 0.0;
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        sum += s_lane[l];
+        count += n_lane[l];
+    }
+}
+
+/* Binned IMAGELIST, indexed by output bin */
+struct BinnedImagelist {
+    vector<string> columns;
+    vector<vector<double>> means;
+    vector<long> nframes;
+};
+
+static void bin_imagelist(FITSFile &f, const SourceFile &source,
+                          const vector<const TimeBin *> &bins,
+                          BinnedImagelist &out) {
+    f.toHDU(source.imagelist_hdu);
+    f.check();
+    for (size_t c = 0; c < out.columns.size(); c++) {
+        int colnum = f.colnum(out.columns[c]);
+        if (colnum == -1) {
+            continue;
+        }
+        vector<double> values = readColumn<double>(f, source.nimages, colnum);
+        f.checkColumn(colnum);
+        for (auto bin : bins) {
+            double sum = 0, count = 0;
+            for (auto &run : bin->rows) {
+                finite_sums(&values[run.source_start], run.count, sum, count);
+            }
+            out.means[c][bin->output] = count > 0 ? sum / count : NAN;
+        }
+    }
+    for (auto bin : bins) {
+        out.nframes[bin->output] = bin->nframes;
+    }
+}
+
+/* Write `values`, `napertures` rows of one value per bin in `bins`, at
+ * output aperture `out_aperture` of the current image. Bins of one source
+ * interleave with those of overlapping sources, so each run of consecutive
+ * output bins is written separately. */
+static void write_bins(FITSFile *out, const vector<const TimeBin *> &bins,
+                       const vector<double> &values, long napertures,
+                       long out_aperture) {
+    long nbins = bins.size();
+    vector<double> run;
+    for (long start = 0; start < nbins;) {
+        long end = start + 1;
+        while ((end < nbins) &&
+               (bins[end]->output == bins[end - 1]->output + 1)) {
+            end++;
+        }
+
+        ImageDimensions tile = {end - start, napertures};
+        run.resize(tile.nimages * tile.napertures);
+        for (long a = 0; a < napertures; a++) {
+            copy(values.begin() + a * nbins + start,
+                 values.begin() + a * nbins + end,
+                 run.begin() + a * tile.nimages);
+        }
+        out->writeImageTile(&run[0], bins[start]->output, out_aperture, tile);
+        start = end;
+    }
+}
+
+struct BinnedImages {
+    map<string, int> hdus;
+    bool weighted;
+};
+
+/* Read `image` of `f` for tile.napertures apertures from `aperture` over
+ * the source rows [lo, lo + tile.nimages) */
+static void read_tile(FITSFile &f, const SourceFile &source,
+                      const string &image, long lo, long aperture,
+                      const ImageDimensions &tile, vector<double> &pixels) {
+    pixels.resize(tile.nimages * tile.napertures);
+    f.toHDU(source.image_hdus.at(image).index);
+    f.check();
+    f.readImageTile(&pixels[0], lo, aperture, tile);
+    metrics.bytes_read += pixels.size() * sizeof(double);
+}
+
+static bool same_layout(const vector<pair<string, ColumnDefinition>> &a,
+                        const vector<pair<string, ColumnDefinition>> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if ((a[i].first != b[i].first) ||
+            (a[i].second.type != b[i].second.type) ||
+            (a[i].second.repeat != b[i].second.repeat) ||
+            (a[i].second.width != b[i].second.width)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bin_images(FITSFile &f, const SourceFile &source,
+                       const vector<const TimeBin *> &bins,
+                       const StitchPlan &plan, const BinnedImages &images,
+                       FITSFile *out, long max_bytes) {
+    long lo = source.nimages, hi = 0;
+    for (auto bin : bins) {
+        for (auto &run : bin->rows) {
+            lo = min(lo, run.source_start);
+            hi = max(hi, run.source_start + run.count);
+        }
+    }
+    long span = hi - lo, nbins = bins.size();
+    long block = max(1L, max_bytes / (2 * span * (long)sizeof(double)));
+
+    vector<double> pixels, errors, values, bin_errors, counts;
+    for (auto &aperture_run : source.aperture_runs) {
+        for (long ap = 0; ap < aperture_run.count; ap += block) {
+            ImageDimensions tile = {span, min(block, aperture_run.count - ap)};
+            long source_ap = aperture_run.source_start + ap;
+            long out_ap = aperture_run.output_start + ap;
+            values.resize(nbins * tile.napertures);
+
+            for (auto &name : plan.image_names) {
+                /* Written along with FLUX */
+                if (images.weighted && (name == "FLUXERR")) {
+                    continue;
+                }
+                bool present = source.image_hdus.count(name);
+                bool flux = images.weighted && (name == "FLUX");
+                bool weighted =
+                    flux && present && source.image_hdus.count("FLUXERR");
+                if (present) {
+                    read_tile(f, source, name, lo, source_ap, tile, pixels);
+                }
+                if (weighted) {
+                    read_tile(f, source, "FLUXERR", lo, source_ap, tile,
+                              errors);
+                }
+                if (flux) {
+                    bin_errors.resize(values.size());
+                    counts.resize(values.size());
+                }
+
+                for (long a = 0; a < tile.napertures; a++) {
+                    const double *row = present ? &pixels[a * span] : NULL;
+                    const double *err_row =
+                        weighted ? &errors[a * span] : NULL;
+                    for (long b = 0; b < nbins; b++) {
+                        double sum = 0, sw = 0, count = 0;
+                        for (auto &run : bins[b]->rows) {
+                            long offset = run.source_start - lo;
+                            if (weighted) {
+                                weighted_sums(row + offset, err_row + offset,
+                                              run.count, sw, sum, count);
+                            } else if (present) {
+                                finite_sums(row + offset, run.count, sum,
+                                            count);
+                            }
+                        }
+
+                        long i = a * nbins + b;
+                        if (weighted) {
+                            values[i] = sw > 0 ? sum / sw : NAN;
+                        } else {
+                            values[i] = count > 0 ? sum / count : NAN;
+                        }
+                        /* Without FLUXERR the FLUX mean is unweighted and
+                         * has no error, rather than a zero one */
+                        if (flux) {
+                            bin_errors[i] = weighted && (sw > 0)
+                                                ? 1 / sqrt(sw)
+                                                : NAN;
+                            counts[i] = count;
+                        }
+                    }
+                }
+
+                out->toHDU(images.hdus.at(name));
+                out->check();
+                write_bins(out, bins, values, tile.napertures, out_ap);
+                if (flux) {
+                    out->toHDU(images.hdus.at("FLUXERR"));
+                    out->check();
+                    write_bins(out, bins, bin_errors, tile.napertures, out_ap);
+                    out->toHDU(images.hdus.at("NPOINTS"));
+                    out->check();
+                    write_bins(out, bins, counts, tile.napertures, out_ap);
+                }
+            }
+        }
+    }
+
+    /* Apertures the file lacks have no data, and no points, in its bins */
+    for (auto &run : missing_apertures(source, plan.dimensions.napertures)) {
+        for (long ap = 0; ap < run.count; ap += block) {
+            long count = min(block, run.count - ap);
+            values.assign(nbins * count, NAN);
+            counts.assign(nbins * count, 0);
+            for (auto &image : images.hdus) {
+                out->toHDU(image.second);
+                out->check();
+                write_bins(out, bins,
+                           image.first == "NPOINTS" ? counts : values, count,
+                           run.output_start + ap);
+            }
+        }
+    }
+}
+
+void write_binned(const StitchPlan &plan, const string &output,
+                  const StitchOptions &options) {
+    double width = options.bin_minutes / (24.0 * 60.0);
+    vector<TimeBin> bins;
+    {
+        PhaseTimer timer("bin.plan");
+        bins = plan_bins(plan, width);
+    }
+    long nbins = bins.size();
+    log << "Binning " << plan.dimensions.nimages << " epochs into " << nbins
+         << " bins of " << options.bin_minutes << " minutes" << endl;
+
+    vector<vector<const TimeBin *>> by_source(plan.sources.size());
+    for (auto &bin : bins) {
+        by_source[bin.source].push_back(&bin);
+    }
+
+    unique_ptr<FITSFile> out(FITSFile::createFile(output));
+
+    /* Catalogue rows of the planned apertures, from each source supplying
+     * some. Rows are copied as bytes where the layout matches the table
+     * built from the first such source, and column by column otherwise. */
+    vector<pair<string, ColumnDefinition>> catalogue_layout;
+    map<string, ColumnDefinition> catalogue;
+    StringArena arena;
+    for (auto &source : plan.sources) {
+        if (source.catalogue_runs.empty()) {
+            continue;
+        }
+        FITSFile f(source.filename);
+        f.toHDU(source.catalogue_hdu);
+        f.check();
+        vector<pair<string, ColumnDefinition>> layout =
+            f.column_description();
+        if (catalogue_layout.empty()) {
+            catalogue_layout = layout;
+            catalogue.insert(layout.begin(), layout.end());
+            vector<string> catalogue_order;
+            for (auto &column : layout) {
+                catalogue_order.push_back(column.first);
+            }
+            out->addBinaryTable("CATALOGUE", catalogue,
+                                plan.dimensions.napertures, catalogue_order);
+        }
+        if (same_layout(layout, catalogue_layout) &&
+            (f.rowBytes() == out->rowBytes())) {
+            copyTableRows(f, out.get(), source.catalogue_runs,
+                          options.max_buffer_bytes);
+        } else {
+            copyColumns(f, out.get(), catalogue, source.dimensions.napertures,
+                        source.catalogue_runs, arena);
+        }
+    }
+
+    /* Only numeric IMAGELIST columns have a meaningful mean */
+    BinnedImagelist imagelist;
+    map<string, ColumnDefinition> imagelist_columns;
+    vector<string> imagelist_order;
+    ColumnDefinition double_column = {1, 1, TDOUBLE};
+    for (auto &name : plan.imagelist_order) {
+        int type = plan.imagelist_columns.at(name).type;
+        if ((type != TSTRING) && (type != TLOGICAL) && (type > 0)) {
+            imagelist.columns.push_back(name);
+            imagelist_columns[name] = double_column;
+            imagelist_order.push_back(name);
+        }
+    }
+    ColumnDefinition count_column = {1, 1, TLONG};
+    imagelist_columns["NFRAMES"] = count_column;
+    imagelist_order.push_back("NFRAMES");
+    imagelist.means.assign(imagelist.columns.size(),
+                           vector<double>(nbins, NAN));
+    imagelist.nframes.assign(nbins, 0);
+
+    out->addBinaryTable("IMAGELIST", imagelist_columns, nbins,
+                        imagelist_order);
+    int imagelist_hdu = out->hduIndex();
+    double bin_minutes = options.bin_minutes;
+    fits_write_key(out->fptr, TDOUBLE, "BINMINS", &bin_minutes,
+                   "Width of the time bins in minutes", &out->status);
+    out->check();
+
+    BinnedImages images;
+    images.weighted = plan.image_names.count("FLUX") &&
+                      plan.image_names.count("FLUXERR");
+    for (auto &name : plan.image_names) {
+        int type = plan.image_types.at(name) == FLOAT_IMG ? FLOAT_IMG
+                                                          : DOUBLE_IMG;
+        out->addImage(name, nbins, plan.dimensions.napertures, type);
+        images.hdus[name] = out->hduIndex();
+    }
+    if (images.weighted) {
+        out->addImage("NPOINTS", nbins, plan.dimensions.napertures,
+                      LONG_IMG);
+        images.hdus["NPOINTS"] = out->hduIndex();
+    }
+
+    {
+        PhaseTimer timer("bin.images");
+        for (size_t s = 0; s < plan.sources.size(); s++) {
+            if (by_source[s].empty()) {
+                continue;
+            }
+            const SourceFile &source = plan.sources[s];
+            log << "Binning " << source.filename << endl;
+            FITSFile f(source.filename);
+            bin_imagelist(f, source, by_source[s], imagelist);
+            bin_images(f, source, by_source[s], plan, images, out.get(),
+                       options.max_buffer_bytes);
+        }
+    }
+
+    out->toHDU(imagelist_hdu);
+    out->check();
+    if (nbins > 0) {
+        for (size_t c = 0; c < imagelist.columns.size(); c++) {
+            writeColumn(out.get(), &imagelist.means[c][0], nbins, 0,
+                        out->colnum(imagelist.columns[c]));
+        }
+        writeColumn(out.get(), &imagelist.nframes[0], nbins, 0,
+                    out->colnum("NFRAMES"));
+    }
+}
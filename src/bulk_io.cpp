@@ -0,0 +1,214 @@
+#include "bulk_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+static runtime_error io_error(const string &what, int error) {
+    return runtime_error("Bulk " + what + " failed: " + strerror(error));
+}
+
+BulkCopier::BulkCopier(char *buffer, long size, int depth)
+    : buffer(buffer), slot_bytes(max(1L, size / max(depth, 1))),
+      depth(max(depth, 1)) {
+    pending.nbytes = 0;
+}
+
+void BulkCopier::copy(int in, off_t in_offset, int out, off_t out_offset,
+                      long nbytes) {
+    if ((pending.nbytes > 0) && (pending.in == in) && (pending.out == out) &&
+        (pending.in_offset + pending.nbytes == in_offset) &&
+        (pending.out_offset + pending.nbytes == out_offset)) {
+        pending.nbytes += nbytes;
+        return;
+    }
+    flush();
+    pending.in = in;
+    pending.out = out;
+    pending.in_offset = in_offset;
+    pending.out_offset = out_offset;
+    pending.nbytes = nbytes;
+}
+
+void BulkCopier::flush() {
+    for (long done = 0; done < pending.nbytes; done += slot_bytes) {
+        Range piece = pending;
+        piece.in_offset += done;
+        piece.out_offset += done;
+        piece.nbytes = min(slot_bytes, pending.nbytes - done);
+        transfer(piece, freeSlot());
+    }
+    pending.nbytes = 0;
+}
+
+void BulkCopier::finish() {
+    flush();
+    drain();
+}
+
+/* One blocking pread and pwrite per piece */
+struct PreadCopier : BulkCopier {
+    PreadCopier(char *buffer, long size) : BulkCopier(buffer, size, 1) {}
+
+    void transfer(const Range &piece, int) {
+        for (long done = 0; done < piece.nbytes;) {
+            ssize_t n = pread(piece.in, buffer + done, piece.nbytes - done,
+                              piece.in_offset + done);
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                throw io_error("read", n < 0 ? errno : EIO);
+            }
+            done += n;
+        }
+        for (long done = 0; done < piece.nbytes;) {
+            ssize_t n = pwrite(piece.out, buffer + done, piece.nbytes - done,
+                               piece.out_offset + done);
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                throw io_error("write", n < 0 ? errno : EIO);
+            }
+            done += n;
+        }
+    }
+
+    int freeSlot() { return 0; }
+    void drain() {}
+};
+
+#ifdef HAVE_LIBURING
+/* Each piece is a read linked to the write of the same slot, so the kernel
+ * starts the write as soon as the read completes. A short read breaks the
+ * link and cancels the write. Completions carry slot * 2, plus one for the
+ * write. */
+struct UringCopier : BulkCopier {
+    UringCopier(char *buffer, long size, int depth)
+        : BulkCopier(buffer, size, depth), lengths(this->depth),
+          inflight(0) {
+        int ret = io_uring_queue_init(2 * this->depth, &ring, 0);
+        if (ret < 0) {
+            throw io_error("io_uring setup", -ret);
+        }
+        for (int slot = 0; slot < this->depth; slot++) {
+            free_slots.push_back(slot);
+        }
+    }
+
+    ~UringCopier() {
+        /* The kernel may still be using the buffer after a failure */
+        while (inflight > 0) {
+            io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+                break;
+            }
+            io_uring_cqe_seen(&ring, cqe);
+            inflight--;
+        }
+        io_uring_queue_exit(&ring);
+    }
+
+    void transfer(const Range &piece, int slot) {
+        char *data = buffer + slot * slot_bytes;
+        lengths[slot] = piece.nbytes;
+        io_uring_sqe *read = io_uring_get_sqe(&ring);
+        io_uring_prep_read(read, piece.in, data, piece.nbytes,
+                           piece.in_offset);
+        read->flags |= IOSQE_IO_LINK;
+        read->user_data = 2 * slot;
+        io_uring_sqe *write = io_uring_get_sqe(&ring);
+        io_uring_prep_write(write, piece.out, data, piece.nbytes,
+                            piece.out_offset);
+        write->user_data = 2 * slot + 1;
+        inflight += 2;
+        int ret = io_uring_submit(&ring);
+        if (ret < 0) {
+            throw io_error("io_uring submit", -ret);
+        }
+    }
+
+    /* Wait for one completion, returning the slot freed if it was a write */
+    int reap() {
+        io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0) {
+            throw io_error("io_uring wait", -ret);
+        }
+        long data = cqe->user_data;
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        inflight--;
+
+        int slot = data / 2;
+        bool write = data % 2;
+        if (res < 0) {
+            throw io_error(write ? "write" : "read", -res);
+        }
+        if (res != lengths[slot]) {
+            throw io_error(write ? "write" : "read", EIO);
+        }
+        return write ? slot : -1;
+    }
+
+    int freeSlot() {
+        while (free_slots.empty()) {
+            int slot = reap();
+            if (slot >= 0) {
+                free_slots.push_back(slot);
+            }
+        }
+        int slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    void drain() {
+        while (inflight > 0) {
+            int slot = reap();
+            if (slot >= 0) {
+                free_slots.push_back(slot);
+            }
+        }
+    }
+
+    io_uring ring;
+    vector<long> lengths;
+    vector<int> free_slots;
+    int inflight;
+};
+#endif
+
+bool bulk_backend_available(const string &backend) {
+#ifdef HAVE_LIBURING
+    if (backend == "uring") {
+        return true;
+    }
+#endif
+    return backend == "pread";
+}
+
+BulkCopier *create_bulk_copier(const string &backend, char *buffer,
+                               long size, int depth) {
+    if (depth < 1) {
+        throw runtime_error("I/O depth must be at least 1");
+    }
+#ifdef HAVE_LIBURING
+    if (backend == "uring") {
+        return new UringCopier(buffer, size, depth);
+    }
+#endif
+    if (backend == "pread") {
+        return new PreadCopier(buffer, size);
+    }
+    throw runtime_error("I/O backend " + backend + " is not available");
+}
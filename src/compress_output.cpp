@@ -0,0 +1,124 @@
+#include "compress_output.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "fits_file.h"
+#include "time_utils.h"
+
+using namespace std;
+
+struct CompressionTotals {
+    double raw_bytes, compressed_bytes;
+};
+
+static long long data_size(FITSFile &f) {
+    LONGLONG headstart, datastart, dataend;
+    fits_get_hduaddrll(f.fptr, &headstart, &datastart, &dataend, &f.status);
+    f.check();
+    return dataend - datastart;
+}
+
+static void compress_image(FITSFile &in, FITSFile *out,
+                           const StitchOptions &options,
+                           CompressionTotals &totals) {
+    char extname[FLEN_VALUE];
+    fits_read_key(in.fptr, TSTRING, "EXTNAME", extname, NULL, &in.status);
+    in.check();
+
+    int image_type = 0;
+    fits_get_img_equivtype(in.fptr, &image_type, &in.status);
+    in.check();
+    ImageDimensions dim = in.imageDimensions();
+    bool floating = (image_type == FLOAT_IMG) || (image_type == DOUBLE_IMG);
+
+    /* RICE cannot store unquantised floats or 64-bit integers losslessly */
+    int algorithm = options.compression;
+    if ((algorithm == RICE_1) &&
+        ((floating && (options.quantize_level == 0)) ||
+         (image_type == LONGLONG_IMG))) {
+        algorithm = GZIP_2;
+    }
+
+    /* One tile per aperture, so a light curve decompresses in one go */
+    long tile[] = {dim.nimages, 1};
+    fits_set_compression_type(out->fptr, algorithm, &out->status);
+    fits_set_tile_dim(out->fptr, 2, tile, &out->status);
+    if (floating) {
+        fits_set_quantize_level(out->fptr, options.quantize_level,
+                                &out->status);
+    }
+    out->check();
+
+    log << "Compressing image " << extname << " with algorithm " << algorithm
+         << endl;
+    out->addImage(extname, dim, image_type);
+
+    /* Integers are copied as long long and floating point values as
+     * double, both of which hold every pixel value exactly */
+    if (floating) {
+        copyImageRows<double>(in, out, dim, 0, options.max_buffer_bytes);
+    } else {
+        copyImageRows<long long>(in, out, dim, 0, options.max_buffer_bytes);
+    }
+    fits_flush_file(out->fptr, &out->status);
+    out->check();
+
+    double raw = data_size(in), compressed = data_size(*out);
+    totals.raw_bytes += raw;
+    totals.compressed_bytes += compressed;
+    log << "Image " << extname << " compressed by a factor of "
+         << (compressed > 0 ? raw / compressed : 0) << endl;
+}
+
+/* Tile-compressed images have to be written whole tiles at a time, in order.
+ * The stitcher fills each aperture row once per source file, so it writes an
+ * uncompressed file first and this pass streams it into compressed form. */
+void compress_file(const string &input, const string &output,
+                   const StitchOptions &options) {
+    auto start = chrono::steady_clock::now();
+    FITSFile in(input);
+    unique_ptr<FITSFile> out(FITSFile::createFile(output));
+    CompressionTotals totals = {0, 0};
+
+    /* A partly compressed file is of no use, so it is removed on failure */
+    try {
+        int nhdu = -1;
+        fits_get_num_hdus(in.fptr, &nhdu, &in.status);
+        in.check();
+
+        for (int i = 1; i < nhdu; i++) {
+            in.toHDU(i);
+            in.check();
+            int hdutype = -1;
+            fits_get_hdu_type(in.fptr, &hdutype, &in.status);
+            in.check();
+
+            if (hdutype == IMAGE_HDU) {
+                compress_image(in, out.get(), options, totals);
+            } else {
+                fits_copy_hdu(in.fptr, out->fptr, 0, &out->status);
+                out->check();
+            }
+        }
+    } catch (...) {
+        out.reset();
+        remove(output.c_str());
+        throw;
+    }
+    out.reset();
+
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    log << "Compressed " << totals.raw_bytes / 1024 / 1024
+         << " MB of images to " << totals.compressed_bytes / 1024 / 1024
+         << " MB (ratio "
+         << (totals.compressed_bytes > 0
+                 ? totals.raw_bytes / totals.compressed_bytes
+                 : 0)
+         << ") at " << totals.raw_bytes / 1024 / 1024 / max(seconds, 1e-9)
+         << " MB/s" << endl;
+}
@@ -0,0 +1,94 @@
+#include "copy_pipeline.h"
+#include <stdexcept>
+
+using namespace std;
+
+BufferPool::BufferPool(int nbuffers, long size) : aborted(false) {
+    for (int i = 0; i < nbuffers; i++) {
+        buffers.push_back(vector<char>(size));
+        available.push_back(&buffers.back());
+    }
+}
+
+vector<char> *BufferPool::acquire() {
+    unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !available.empty() || aborted; });
+    if (aborted) {
+        throw runtime_error("Image copy aborted");
+    }
+    vector<char> *buffer = available.back();
+    available.pop_back();
+    return buffer;
+}
+
+void BufferPool::release(vector<char> *buffer) {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        available.push_back(buffer);
+    }
+    cond.notify_one();
+}
+
+void BufferPool::abort() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+    }
+    cond.notify_all();
+}
+
+WriteQueue::WriteQueue(bool threaded) : threaded(threaded), producers(0) {}
+
+void WriteQueue::push(function<void()> task) {
+    if (!threaded) {
+        task();
+        return;
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    cond.notify_all();
+}
+
+void WriteQueue::addProducer() {
+    lock_guard<std::mutex> lock(mutex);
+    producers++;
+}
+
+void WriteQueue::removeProducer() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        producers--;
+    }
+    cond.notify_all();
+}
+
+void WriteQueue::run() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock,
+                      [this] { return !tasks.empty() || producers == 0; });
+            if (tasks.empty()) {
+                return;
+            }
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        if (error) {
+            continue;
+        }
+
+        try {
+            task();
+        } catch (...) {
+            error = current_exception();
+            if (on_error) {
+                on_error();
+            }
+        }
+    }
+}
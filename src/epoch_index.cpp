@@ -0,0 +1,274 @@
+#include "epoch_index.h"
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include "time_utils.h"
+
+using namespace std;
+
+/* MJD of the Unix epoch */
+static const double mjd_unix_epoch = 40587.0;
+
+static string night_name(double mjd) {
+    time_t t = (time_t)floor((mjd - 0.5 - mjd_unix_epoch) * 86400.0);
+    struct tm utc;
+    gmtime_r(&t, &utc);
+    char buf[16];
+    strftime(buf, sizeof(buf), "%Y-%m-%d", &utc);
+    return buf;
+}
+
+vector<IndexEntry> night_entries(const vector<double> &tmid, double gap) {
+    vector<IndexEntry> nights;
+    long start = 0;
+    for (long i = 1; i <= (long)tmid.size(); i++) {
+        if ((i < (long)tmid.size()) && (tmid[i] - tmid[i - 1] <= gap)) {
+            continue;
+        }
+        IndexEntry night;
+        night.type = "NIGHT";
+        night.name = night_name(tmid[start]);
+        night.start = start;
+        night.stop = i;
+        night.nrows = i - start;
+        night.mjd.min = tmid[start];
+        night.mjd.max = tmid[i - 1];
+        nights.push_back(night);
+        start = i;
+    }
+    return nights;
+}
+
+bool map_entry(const vector<Segment> &segments, const vector<double> &tmid,
+               IndexEntry &entry) {
+    long start = -1, stop = -1, nrows = 0;
+    MJDRange mjd = {INFINITY, -INFINITY};
+    for (auto &segment : segments) {
+        long first = max(entry.start, segment.source_start);
+        long last = min(entry.stop, segment.source_start + segment.count);
+        if (first >= last) {
+            continue;
+        }
+        long out = segment.output_start + (first - segment.source_start);
+        long count = last - first;
+        start = (start < 0) ? out : min(start, out);
+        stop = max(stop, out + count);
+        nrows += count;
+        for (long row = out; row < out + count; row++) {
+            mjd.min = min(mjd.min, tmid[row]);
+            mjd.max = max(mjd.max, tmid[row]);
+        }
+    }
+    if (nrows == 0) {
+        return false;
+    }
+    entry.start = start;
+    entry.stop = stop;
+    entry.nrows = nrows;
+    entry.mjd = mjd;
+    return true;
+}
+
+void write_index_table(FITSFile *out, const vector<IndexEntry> &entries) {
+    long nrows = entries.size();
+    long width = 1;
+    for (auto &entry : entries) {
+        width = max(width, (long)entry.name.size());
+    }
+
+    map<string, ColumnDefinition> columns;
+    vector<string> order;
+    auto add_column = [&](const string &name, int type, long width) {
+        ColumnDefinition def = {1, width, type};
+        columns[name] = def;
+        order.push_back(name);
+    };
+    add_column("TYPE", TSTRING, 5);
+    add_column("NAME", TSTRING, width);
+    add_column("START", TLONG, 1);
+    add_column("STOP", TLONG, 1);
+    add_column("NROWS", TLONG, 1);
+    add_column("MJD_MIN", TDOUBLE, 1);
+    add_column("MJD_MAX", TDOUBLE, 1);
+    out->addBinaryTable("INDEX", columns, nrows, order);
+    if (nrows == 0) {
+        return;
+    }
+
+    vector<char *> strings(nrows);
+    for (auto &column : {"TYPE", "NAME"}) {
+        for (long i = 0; i < nrows; i++) {
+            const string &value = (string(column) == "TYPE")
+                                      ? entries[i].type
+                                      : entries[i].name;
+            strings[i] = (char *)value.c_str();
+        }
+        int colnum = out->colnum(column);
+        fits_write_col(out->fptr, TSTRING, colnum, 1, 1, nrows, &strings[0],
+                       &out->status);
+        out->checkColumn(colnum);
+    }
+
+    vector<long> rows(nrows);
+    for (long i = 0; i < nrows; i++) {
+        rows[i] = entries[i].start;
+    }
+    writeColumn(out, &rows[0], nrows, 0, out->colnum("START"));
+    for (long i = 0; i < nrows; i++) {
+        rows[i] = entries[i].stop;
+    }
+    writeColumn(out, &rows[0], nrows, 0, out->colnum("STOP"));
+    for (long i = 0; i < nrows; i++) {
+        rows[i] = entries[i].nrows;
+    }
+    writeColumn(out, &rows[0], nrows, 0, out->colnum("NROWS"));
+
+    vector<double> mjd(nrows);
+    for (long i = 0; i < nrows; i++) {
+        mjd[i] = entries[i].mjd.min;
+    }
+    writeColumn(out, &mjd[0], nrows, 0, out->colnum("MJD_MIN"));
+    for (long i = 0; i < nrows; i++) {
+        mjd[i] = entries[i].mjd.max;
+    }
+    writeColumn(out, &mjd[0], nrows, 0, out->colnum("MJD_MAX"));
+}
+
+vector<IndexEntry> read_index(FITSFile &f) {
+    f.toHDU("INDEX");
+    f.check("no INDEX table");
+    long nrows = 0;
+    fits_get_num_rows(f.fptr, &nrows, &f.status);
+    f.check();
+    vector<IndexEntry> entries(nrows);
+    if (nrows == 0) {
+        return entries;
+    }
+
+    vector<string> types = readStringColumn(f, nrows, f.colnum("TYPE"));
+    vector<string> names = readStringColumn(f, nrows, f.colnum("NAME"));
+    vector<long> start = readColumn<long>(f, nrows, f.colnum("START"));
+    vector<long> stop = readColumn<long>(f, nrows, f.colnum("STOP"));
+    vector<long> count = readColumn<long>(f, nrows, f.colnum("NROWS"));
+    vector<double> mjd_min = readColumn<double>(f, nrows, f.colnum("MJD_MIN"));
+    vector<double> mjd_max = readColumn<double>(f, nrows, f.colnum("MJD_MAX"));
+    f.check();
+
+    for (long i = 0; i < nrows; i++) {
+        IndexEntry &entry = entries[i];
+        entry.type = types[i];
+        entry.name = names[i];
+        entry.start = start[i];
+        entry.stop = stop[i];
+        entry.nrows = count[i];
+        entry.mjd.min = mjd_min[i];
+        entry.mjd.max = mjd_max[i];
+    }
+    return entries;
+}
+
+static string file_basename(const string &path) {
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+const IndexEntry &find_index_entry(const vector<IndexEntry> &entries,
+                                   const string &name) {
+    for (auto &entry : entries) {
+        if ((entry.name == name) ||
+            ((entry.type == "FILE") && (file_basename(entry.name) == name))) {
+            return entry;
+        }
+    }
+    throw runtime_error("No INDEX entry " + name);
+}
+
+void print_index(const string &filename) {
+    FITSFile f(filename);
+    cout << setw(6) << left << "TYPE" << setw(12) << right << "START"
+         << setw(12) << "STOP" << setw(12) << "NROWS" << setw(16) << "MJD_MIN"
+         << setw(16) << "MJD_MAX" << "  NAME" << endl;
+    cout << fixed << setprecision(5);
+    for (auto &entry : read_index(f)) {
+        cout << setw(6) << left << entry.type << setw(12) << right
+             << entry.start << setw(12) << entry.stop << setw(12)
+             << entry.nrows << setw(16) << entry.mjd.min << setw(16)
+             << entry.mjd.max << "  " << entry.name << endl;
+    }
+}
+
+void extract_slice(const string &input, const string &name,
+                   const string &output, long max_bytes) {
+    FITSFile in(input);
+    const IndexEntry entry = find_index_entry(read_index(in), name);
+    long nimages = entry.stop - entry.start;
+    log << "Extracting " << entry.type << " " << entry.name << ", epochs "
+         << entry.start << " to " << entry.stop << " of " << input << endl;
+
+    unique_ptr<FITSFile> out(FITSFile::createFile(output));
+    int nhdu = -1;
+    fits_get_num_hdus(in.fptr, &nhdu, &in.status);
+    in.check();
+
+    for (int i = 1; i < nhdu; i++) {
+        in.toHDU(i);
+        in.check();
+        int hdutype = -1;
+        fits_get_hdu_type(in.fptr, &hdutype, &in.status);
+        in.check();
+        char extname[FLEN_VALUE];
+        fits_read_key(in.fptr, TSTRING, "EXTNAME", extname, NULL, &in.status);
+        in.check();
+
+        if (hdutype == IMAGE_HDU) {
+            int image_type = 0;
+            fits_get_img_equivtype(in.fptr, &image_type, &in.status);
+            in.check();
+            ImageDimensions dim = in.imageDimensions();
+            dim.nimages = nimages;
+            out->addImage(extname, dim, image_type);
+            if ((image_type == FLOAT_IMG) || (image_type == DOUBLE_IMG)) {
+                copyImageRows<double>(in, out.get(), dim, 0, max_bytes,
+                                      entry.start);
+            } else {
+                copyImageRows<long long>(in, out.get(), dim, 0, max_bytes,
+                                         entry.start);
+            }
+        } else if (string(extname) == "IMAGELIST") {
+            map<string, ColumnDefinition> columns;
+            vector<string> order;
+            for (auto &column : in.column_description()) {
+                columns.insert(column);
+                order.push_back(column.first);
+            }
+            out->addBinaryTable("IMAGELIST", columns, nimages, order);
+            vector<Segment> rows(1);
+            rows[0].source_start = entry.start;
+            rows[0].output_start = 0;
+            rows[0].count = nimages;
+            /* The rebuilt table only has the source layout for scalar
+             * columns */
+            if (in.rowBytes() == out->rowBytes()) {
+                copyTableRows(in, out.get(), rows, max_bytes);
+            } else {
+                long nrows = 0;
+                fits_get_num_rows(in.fptr, &nrows, &in.status);
+                in.check();
+                StringArena arena;
+                copyColumns(in, out.get(), columns, nrows, rows, arena);
+            }
+        } else if ((string(extname) == "INDEX") ||
+                   (string(extname) == "STATS")) {
+            /* Both describe the whole file rather than the slice */
+            continue;
+        } else {
+            fits_copy_hdu(in.fptr, out->fptr, 0, &out->status);
+            out->check();
+        }
+    }
+}
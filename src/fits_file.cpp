@@ -3,65 +3,131 @@
 #include <stdexcept>
 #include <iostream>
 #include <map>
-#include <valarray>
 #include <sstream>
 #include <algorithm>
+#include <memory>
 
 #include "time_utils.h"
+#include "run_metrics.h"
 
 
 using namespace std;
 
+atomic<long> FITSFile::nopened(0);
+
 FITSFile::FITSFile(const string &filename) : FITSFile() {
     this->filename = filename;
     fits_open_file(&fptr, filename.c_str(), READONLY, &status);
     check();
+    nopened++;
 }
 
 FITSFile *FITSFile::createFile(const string &filename) {
     stringstream ss;
     ss << "!" << filename;
 
-    FITSFile *f = new FITSFile();
+    unique_ptr<FITSFile> f(new FITSFile());
     f->filename = filename;
     fits_create_file(&f->fptr, ss.str().c_str(), &f->status);
     f->check();
+    nopened++;
 
     /* Add empty primary */
     fits_write_imghdr(f->fptr, 8, 0, NULL, &f->status);
     f->check();
-    return f;
+    return f.release();
 }
 
-MJDRange FITSFile::mjd_range() {
+vector<double> FITSFile::tmid() {
     long nrows = nimages();
     vector<double> mjd(nrows);
     toHDU("IMAGELIST");
 
-    fits_read_col(fptr, TDOUBLE, colnum("TMID"), 1, 1, nrows, NULL, &mjd[0],
-                  NULL, &status);
-    check();
-
-    MJDRange out;
-    auto minmax_values = minmax_element(mjd.begin(), mjd.end());
-    out.min = *minmax_values.first;
-    out.max = *minmax_values.second;
-    return out;
+    int tmid_colnum = colnum("TMID");
+    fits_read_col(fptr, TDOUBLE, tmid_colnum, 1, 1, nrows, NULL, &mjd[0], NULL,
+                  &status);
+    checkColumn(tmid_colnum);
+    return mjd;
 }
 
 void FITSFile::close() {
     if (fptr) {
-        fits_close_file(fptr, &status);
-        check();
+        fitsfile *closing = fptr;
         fptr = NULL;
+        fits_close_file(closing, &status);
+        check();
     }
 }
 
-void FITSFile::check() {
-    if (status) {
-        fits_report_error(stderr, status);
-        exit(status);
+FITSFile::~FITSFile() {
+    /* Destructors run while unwinding from errors, so must not throw */
+    try {
+        close();
+    } catch (const FitsError &e) {
+        log << "Error closing file: " << e.what() << endl;
+    }
+}
+
+static string fits_error_message(int status, const string &filename, int hdu,
+                                 const string &context,
+                                 const string &message) {
+    stringstream ss;
+    ss << (filename.empty() ? "<unnamed>" : filename) << ", HDU " << hdu;
+    if (!context.empty()) {
+        ss << ", " << context;
     }
+    ss << ": " << message << " (cfitsio status " << status << ")";
+    return ss.str();
+}
+
+FitsError::FitsError(int status, const string &filename, int hdu,
+                     const string &context, const string &message)
+    : runtime_error(
+          fits_error_message(status, filename, hdu, context, message)),
+      status(status), filename(filename), hdu(hdu), context(context) {}
+
+/* Throw a FitsError for the current status, with cfitsio's message stack,
+ * and reset the status so the file can still be closed */
+void FITSFile::check(const string &context) {
+    metrics.fits_calls++;
+    if (!status) {
+        return;
+    }
+
+    char text[FLEN_STATUS];
+    fits_get_errstatus(status, text);
+    string message = text;
+    char line[FLEN_ERRMSG];
+    while (fits_read_errmsg(line)) {
+        message += string("; ") + line;
+    }
+
+    int hdunum = 0;
+    if (fptr) {
+        fits_get_hdu_num(fptr, &hdunum);
+    }
+    int failed = status;
+    status = 0;
+    throw FitsError(failed, filename, hdunum - 1, context, message);
+}
+
+void FITSFile::checkColumn(int colnum) {
+    if (!status) {
+        metrics.fits_calls++;
+        return;
+    }
+
+    /* Look the name up with a separate status, the file's is set */
+    stringstream key, context;
+    key << "TTYPE" << colnum;
+    char name[FLEN_VALUE] = "";
+    int key_status = 0;
+    fits_read_key(fptr, TSTRING, key.str().c_str(), name, NULL, &key_status);
+    context << "column " << colnum;
+    if (key_status == 0) {
+        context << " (" << name << ")";
+    }
+    check(context.str());
 }
 
 void FITSFile::toHDU(const string &name) {
@@ -72,6 +138,24 @@ void FITSFile::toHDU(int index) {
     fits_movabs_hdu(fptr, index + 1, NULL, &status);
 }
 
+int FITSFile::hduIndex() {
+    int hdunum = 0;
+    fits_get_hdu_num(fptr, &hdunum);
+    return hdunum - 1;
+}
+
+double FITSFile::readKey(const string &name, double default_value) {
+    double value = default_value;
+    fits_read_key(fptr, TDOUBLE, name.c_str(), &value, NULL, &status);
+    if (status == KEY_NO_EXIST) {
+        status = 0;
+        fits_clear_errmsg();
+        return default_value;
+    }
+    check();
+    return value;
+}
+
 int FITSFile::colnum(const string &name) {
     int colnum = -1;
     fits_get_colnum(fptr, CASEINSEN, (char *)name.c_str(), &colnum, &status);
@@ -95,10 +179,11 @@ ImageDimensions FITSFile::imageDimensions() {
     return out;
 }
 
-void FITSFile::addImage(const string &name, long nimages, long napertures) {
-    log << "Adding image " << name << endl;
+void FITSFile::addImage(const string &name, long nimages, long napertures,
+                        int image_type) {
+    log << "Adding image " << name << ", type " << image_type << endl;
     long naxes[] = {nimages, napertures};
-    fits_create_img(fptr, DOUBLE_IMG, 2, naxes, &status);
+    fits_create_img(fptr, image_type, 2, naxes, &status);
     check();
 
     fits_write_key(fptr, TSTRING, "EXTNAME", (char *)name.c_str(), NULL,
@@ -136,45 +221,56 @@ vector<pair<string, ColumnDefinition>> FITSFile::column_description() {
 
 void FITSFile::addBinaryTable(
     const string &name, const map<string, ColumnDefinition> &column_description,
-    long nrows) {
-    vector<char *> column_names(nrows), column_types(nrows);
-    int i = 0;
-    for (auto row : column_description) {
-        column_names[i] = (char *)row.first.c_str();
-        if (row.second.type == TSTRING) {
+    long nrows, const vector<string> &order) {
+    vector<string> names = order;
+    if (names.empty()) {
+        for (auto &column : column_description) {
+            names.push_back(column.first);
+        }
+    }
+
+    /* TFORM strings for string columns are built here and must outlive the
+     * fits_create_tbl call */
+    vector<string> forms;
+    for (auto &column : names) {
+        const ColumnDefinition &def = column_description.at(column);
+        switch (def.type) {
+        case TSTRING: {
             stringstream ss;
-            ss << row.second.width << "A";
-            column_types[i] = (char *)ss.str().c_str();
-        } else {
-            switch (row.second.type) {
-            case TDOUBLE:
-                column_types[i] = "1D";
-                break;
-            case TLONGLONG:
-                column_types[i] = "1K";
-                break;
-            case TLONG:
-                column_types[i] = "1J";
-                break;
-            case TFLOAT:
-                column_types[i] = "1E";
-                break;
-            case TLOGICAL:
-                column_types[i] = "1L";
-                break;
-            case TSTRING:
-                break;
-            default:
-                log << "No string conversion for column " << row.first
-                     << ", type " << row.second.type << endl;
-                break;
-            }
+            ss << def.width << "A";
+            forms.push_back(ss.str());
+            break;
+        }
+        case TDOUBLE:
+            forms.push_back("1D");
+            break;
+        case TLONGLONG:
+            forms.push_back("1K");
+            break;
+        case TLONG:
+            forms.push_back("1J");
+            break;
+        case TFLOAT:
+            forms.push_back("1E");
+            break;
+        case TLOGICAL:
+            forms.push_back("1L");
+            break;
+        default:
+            log << "No string conversion for column " << column << ", type "
+                 << def.type << endl;
+            forms.push_back("");
+            break;
         }
-        i++;
     }
-    fits_create_tbl(fptr, BINARY_TBL, nrows, column_description.size(),
-                    &column_names[0], &column_types[0], NULL,
-                    (char *)name.c_str(), &status);
+
+    vector<char *> column_names, column_types;
+    for (size_t i = 0; i < names.size(); i++) {
+        column_names.push_back((char *)names[i].c_str());
+        column_types.push_back((char *)forms[i].c_str());
+    }
+    fits_create_tbl(fptr, BINARY_TBL, nrows, names.size(), &column_names[0],
+                    &column_types[0], NULL, (char *)name.c_str(), &status);
     check();
 }
 
@@ -187,8 +283,9 @@ long FITSFile::nimages() {
     return nrows;
 }
 
-void addToBoolColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
-                     int source_colnum, int dest_colnum) {
+void addToBoolColumn(FITSFile &source, FITSFile *dest, long nrows,
+                     const vector<Segment> &segments, int source_colnum,
+                     int dest_colnum) {
     std::vector<int> data(nrows);
     fits_read_col(source.fptr, TLOGICAL, source_colnum, 1, 1, nrows, NULL,
                   &data[0], NULL, &source.status);
@@ -196,60 +293,224 @@ void addToBoolColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
         source.status = 0;
         fits_clear_errmsg();
     } else {
-        source.check();
-        fits_write_col(dest->fptr, TLOGICAL, dest_colnum, start + 1, 1,
-                       data.size(), &data[0], &dest->status);
-        dest->check();
+        source.checkColumn(source_colnum);
+        for (auto &segment : segments) {
+            fits_write_col(dest->fptr, TLOGICAL, dest_colnum,
+                           segment.output_start + 1, 1, segment.count,
+                           &data[segment.source_start], &dest->status);
+            dest->checkColumn(dest_colnum);
+        }
+    }
+}
+
+char **StringArena::reserve(long nrows, long width) {
+    size_t stride = width + 1;
+    if (data.size() < nrows * stride) {
+        data.resize(nrows * stride);
+    }
+    rows.resize(nrows);
+    for (long i = 0; i < nrows; i++) {
+        rows[i] = &data[i * stride];
     }
+    /* Not &rows[0], which is undefined when there are no rows */
+    return rows.data();
 }
 
-void addToStringColumn(FITSFile &source, FITSFile *dest, long nrows, long start,
-                       int source_colnum, int dest_colnum,
-                       const ColumnDefinition &defs) {
-    valarray<char *> cptr(nrows);
-    for (int i = 0; i < nrows; i++) {
-        cptr[i] = new char[defs.width + 1];
+vector<string> readStringColumn(FITSFile &f, long nrows, int colnum) {
+    vector<string> out(nrows);
+    if (nrows == 0) {
+        return out;
     }
-    fits_read_col_str(source.fptr, source_colnum, 1, 1, nrows, NULL, &cptr[0],
+    int width = 0;
+    fits_get_col_display_width(f.fptr, colnum, &width, &f.status);
+    f.checkColumn(colnum);
+
+    StringArena arena;
+    char **values = arena.reserve(nrows, width);
+    fits_read_col_str(f.fptr, colnum, 1, 1, nrows, NULL, values, NULL,
+                      &f.status);
+    f.checkColumn(colnum);
+    for (long i = 0; i < nrows; i++) {
+        string value = values[i];
+        size_t start = value.find_first_not_of(' ');
+        out[i] = (start == string::npos)
+                     ? ""
+                     : value.substr(start,
+                                    value.find_last_not_of(' ') - start + 1);
+    }
+    return out;
+}
+
+void addToStringColumn(FITSFile &source, FITSFile *dest, long nrows,
+                       const vector<Segment> &segments, int source_colnum,
+                       int dest_colnum, StringArena &arena) {
+    /* The source may hold wider strings than the output column */
+    int type = 0;
+    long repeat = 0, width = 0;
+    fits_get_coltype(source.fptr, source_colnum, &type, &repeat, &width,
+                     &source.status);
+    source.checkColumn(source_colnum);
+
+    char **cptr = arena.reserve(nrows, width);
+    fits_read_col_str(source.fptr, source_colnum, 1, 1, nrows, NULL, cptr,
                       NULL, &source.status);
     if (source.status == COL_NOT_FOUND) {
         source.status = 0;
         fits_clear_errmsg();
     } else {
-        source.check();
-        fits_write_col(dest->fptr, TSTRING, dest_colnum, start + 1, 1, nrows,
-                       &cptr[0], &dest->status);
-        dest->check();
+        source.checkColumn(source_colnum);
+        for (auto &segment : segments) {
+            fits_write_col(dest->fptr, TSTRING, dest_colnum,
+                           segment.output_start + 1, 1, segment.count,
+                           &cptr[segment.source_start], &dest->status);
+            dest->checkColumn(dest_colnum);
+        }
     }
+}
+
+void copyColumns(FITSFile &source, FITSFile *dest,
+                 const map<string, ColumnDefinition> &columns, long nrows,
+                 const vector<Segment> &segments, StringArena &arena) {
+    for (auto column : columns) {
+        int source_colnum = source.colnum(column.first);
+        int dest_colnum = dest->colnum(column.first);
 
-    for (int i = 0; i < nrows; i++) {
-        delete cptr[i];
+        if (source_colnum == -1) {
+            continue;
+        }
+
+        switch (column.second.type) {
+        case TDOUBLE:
+            addToColumn<double>(source, dest, nrows, segments, source_colnum,
+                                dest_colnum);
+            break;
+        case TFLOAT:
+            addToColumn<float>(source, dest, nrows, segments, source_colnum,
+                               dest_colnum);
+            break;
+        case TINT:
+            addToColumn<int>(source, dest, nrows, segments, source_colnum,
+                             dest_colnum);
+            break;
+        case TLONG:
+            addToColumn<long>(source, dest, nrows, segments, source_colnum,
+                              dest_colnum);
+            break;
+        case TLONGLONG:
+            addToColumn<long>(source, dest, nrows, segments, source_colnum,
+                              dest_colnum);
+            break;
+        case TLOGICAL:
+            addToBoolColumn(source, dest, nrows, segments, source_colnum,
+                            dest_colnum);
+            break;
+        case TSTRING:
+            addToStringColumn(source, dest, nrows, segments, source_colnum,
+                              dest_colnum, arena);
+            break;
+        default:
+            log << "Not implemented: " << column.first << " "
+                 << column.second.type << endl;
+            break;
+        }
     }
 }
 
-vector<double> FITSFile::readWholeImage() {
-    ImageDimensions dim = imageDimensions();
-    vector<double> out(dim.nimages * dim.napertures);
-    long fpixel[] = {1, 1};
-    long lpixel[] = {dim.nimages, dim.napertures};
+long FITSFile::rowBytes() {
+    long naxis1 = 0;
+    fits_read_key(fptr, TLONG, "NAXIS1", &naxis1, NULL, &status);
+    check();
+    return naxis1;
+}
+
+void copyTableRows(FITSFile &source, FITSFile *dest,
+                   const vector<Segment> &segments, long max_bytes) {
+    long row_bytes = source.rowBytes();
+    if (dest->rowBytes() != row_bytes) {
+        stringstream ss;
+        ss << "rows of " << row_bytes << " bytes cannot be copied from "
+           << source.filename << " into rows of " << dest->rowBytes()
+           << " bytes";
+        throw FitsError(BAD_ROW_WIDTH, dest->filename, dest->hduIndex(),
+                        "copying table rows", ss.str());
+    }
+    long block_rows = max(1L, max_bytes / max(row_bytes, 1L));
+    long longest = 0;
+    for (auto &segment : segments) {
+        longest = max(longest, segment.count);
+    }
+    vector<unsigned char> buffer(min(block_rows, longest) * row_bytes);
+    for (auto &segment : segments) {
+        for (long row = 0; row < segment.count; row += block_rows) {
+            long nrows = min(block_rows, segment.count - row);
+            fits_read_tblbytes(source.fptr, segment.source_start + row + 1, 1,
+                               nrows * row_bytes, &buffer[0], &source.status);
+            source.check();
+            fits_write_tblbytes(dest->fptr, segment.output_start + row + 1, 1,
+                                nrows * row_bytes, &buffer[0], &dest->status);
+            dest->check();
+        }
+    }
+}
+
+template <typename T>
+void FITSFile::readImageTile(T *data, long start_image, long start_aperture,
+                             const ImageDimensions &tile) {
+    long fpixel[] = {start_image + 1, start_aperture + 1};
+    long lpixel[] = {start_image + tile.nimages,
+                     start_aperture + tile.napertures};
     long inc[] = {1, 1};
 
-    fits_read_subset(fptr, TDOUBLE, fpixel, lpixel, inc, NULL, &out[0], NULL,
-                     &status);
+    fits_read_subset(fptr, FitsDatatype<T>::value, fpixel, lpixel, inc, NULL,
+                     data, NULL, &status);
     check();
-
-    return out;
 }
 
-void FITSFile::writeImageSubset(const vector<double> &data, long start_image,
-                                const ImageDimensions &dim) {
-    long fpixel[] = {start_image + 1, 1};
-    long lpixel[] = {start_image + dim.nimages, dim.napertures};
-    fits_write_subset(fptr, TDOUBLE, fpixel, lpixel, (double *)&data[0],
+template <typename T>
+void FITSFile::writeImageTile(const T *data, long start_image,
+                              long start_aperture,
+                              const ImageDimensions &tile) {
+    long fpixel[] = {start_image + 1, start_aperture + 1};
+    long lpixel[] = {start_image + tile.nimages,
+                     start_aperture + tile.napertures};
+    fits_write_subset(fptr, FitsDatatype<T>::value, fpixel, lpixel, (T *)data,
                       &status);
     check();
 }
 
+#define INSTANTIATE_IMAGE_TILE(T)                                              \
+    template void FITSFile::readImageTile<T>(T *, long, long,                  \
+                                             const ImageDimensions &);         \
+    template void FITSFile::writeImageTile<T>(const T *, long, long,           \
+                                              const ImageDimensions &);
+
+INSTANTIATE_IMAGE_TILE(unsigned char)
+INSTANTIATE_IMAGE_TILE(signed char)
+INSTANTIATE_IMAGE_TILE(short)
+INSTANTIATE_IMAGE_TILE(unsigned short)
+INSTANTIATE_IMAGE_TILE(int)
+INSTANTIATE_IMAGE_TILE(unsigned int)
+INSTANTIATE_IMAGE_TILE(long long)
+INSTANTIATE_IMAGE_TILE(float)
+INSTANTIATE_IMAGE_TILE(double)
+
+size_t imagePixelSize(int image_type) {
+    switch (image_type) {
+    case BYTE_IMG:
+    case SBYTE_IMG:
+        return 1;
+    case SHORT_IMG:
+    case USHORT_IMG:
+        return 2;
+    case LONG_IMG:
+    case ULONG_IMG:
+    case FLOAT_IMG:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
 template <>
 std::vector<double> readColumn<double>(FITSFile &f, long nrows, int colnum) {
     std::vector<double> data(nrows);
@@ -283,31 +544,33 @@ std::vector<long> readColumn<long>(FITSFile &f, long nrows, int colnum) {
 }
 
 template <>
-void writeColumn(FITSFile *f, std::vector<double> &data, long start,
+void writeColumn(FITSFile *f, double *data, long nelements, long start,
                  int colnum) {
-    fits_write_col(f->fptr, TDOUBLE, colnum, start + 1, 1, data.size(),
-                   &data[0], &f->status);
-    f->check();
+    fits_write_col(f->fptr, TDOUBLE, colnum, start + 1, 1, nelements, data,
+                   &f->status);
+    f->checkColumn(colnum);
 }
 
 template <>
-void writeColumn(FITSFile *f, std::vector<int> &data, long start, int colnum) {
-    fits_write_col(f->fptr, TINT, colnum, start + 1, 1, data.size(), &data[0],
+void writeColumn(FITSFile *f, int *data, long nelements, long start,
+                 int colnum) {
+    fits_write_col(f->fptr, TINT, colnum, start + 1, 1, nelements, data,
                    &f->status);
-    f->check();
+    f->checkColumn(colnum);
 }
 
 template <>
-void writeColumn(FITSFile *f, std::vector<long> &data, long start, int colnum) {
-    fits_write_col(f->fptr, TLONG, colnum, start + 1, 1, data.size(), &data[0],
+void writeColumn(FITSFile *f, long *data, long nelements, long start,
+                 int colnum) {
+    fits_write_col(f->fptr, TLONG, colnum, start + 1, 1, nelements, data,
                    &f->status);
-    f->check();
+    f->checkColumn(colnum);
 }
 
 template <>
-void writeColumn(FITSFile *f, std::vector<float> &data, long start,
+void writeColumn(FITSFile *f, float *data, long nelements, long start,
                  int colnum) {
-    fits_write_col(f->fptr, TFLOAT, colnum, start + 1, 1, data.size(), &data[0],
+    fits_write_col(f->fptr, TFLOAT, colnum, start + 1, 1, nelements, data,
                    &f->status);
-    f->check();
+    f->checkColumn(colnum);
 }
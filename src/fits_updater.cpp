@@ -1,94 +1,621 @@
 #include "fits_updater.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <chrono>
 #include <fitsio.h>
 
 #include "fits_file.h"
+#include "copy_pipeline.h"
+#include "mapped_file.h"
+#include "bulk_io.h"
+#include "transpose.h"
 #include "time_utils.h"
+#include "run_metrics.h"
+#include "aperture_stats.h"
+#include "epoch_index.h"
 
 using namespace std;
 
-FitsUpdater::FitsUpdater(const ImageDimensions &dim,
-                         const map<string, ColumnDefinition> &imagelist_columns,
-                         const map<string, ColumnDefinition> &catalogue_columns,
-                         const set<string> image_names)
-    : outfile(NULL), dimensions(dim), imagelist_columns(imagelist_columns),
-      catalogue_columns(catalogue_columns), image_names(image_names),
-      currentImage(0) {}
-
-void FitsUpdater::updateImagelist(FITSFile &f) {
-    outfile->toHDU("IMAGELIST");
-    f.toHDU("IMAGELIST");
-    long nrows = f.nimages();
-    for (auto column : imagelist_columns) {
-        int source_colnum = f.colnum(column.first);
-        int dest_colnum = outfile->colnum(column.first);
-
-        if (source_colnum == -1) {
+FitsUpdater::FitsUpdater(const StitchPlan &plan, const StitchOptions &options)
+    : outfile(NULL), dimensions(plan.dimensions),
+      imagelist_columns(plan.imagelist_columns),
+      catalogue_columns(plan.catalogue_columns),
+      imagelist_order(plan.imagelist_order), image_names(plan.image_names),
+      image_types(plan.image_types),
+      options(options), catalogue_hdu(-1), imagelist_hdu(-1), pool(NULL),
+      writer(NULL), tile_bytes(0), epoch_major(NULL), output_map(NULL) {}
+
+/* Largest block of an image that fits in `max_pixels` values. Whole aperture
+ * rows are preferred so that source reads stay contiguous on disk; the time
+ * axis is only split when a single row does not fit. */
+static ImageDimensions tileShape(const ImageDimensions &dim, long max_pixels) {
+    ImageDimensions tile;
+    max_pixels = max(max_pixels, 1L);
+    tile.nimages = min(dim.nimages, max_pixels);
+    tile.napertures = max(1L, min(dim.napertures, max_pixels / tile.nimages));
+    return tile;
+}
+
+/* The output epochs the segments of `sources` cover, as one segment. A
+ * count of zero means they cover none. */
+static Segment output_span(const vector<const SourceFile *> &sources) {
+    long start = -1, end = -1;
+    for (auto source : sources) {
+        for (auto &segment : source->segments) {
+            if ((start < 0) || (segment.output_start < start)) {
+                start = segment.output_start;
+            }
+            end = max(end, segment.output_start + segment.count);
+        }
+    }
+    Segment span = {0, max(start, 0L), end - start};
+    return span;
+}
+
+static bool same_runs(const vector<Segment> &a, const vector<Segment> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if ((a[i].source_start != b[i].source_start) ||
+            (a[i].output_start != b[i].output_start) ||
+            (a[i].count != b[i].count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sources merged by TMID interleave in the output, leaving each with many
+ * short segments. Sources whose output spans overlap are copied as one
+ * group, so that output tiles can be assembled from block reads of each,
+ * when `assemble` is set, they take the same apertures and together fill
+ * their span. Any other source is a group of its own. */
+static vector<vector<const SourceFile *> >
+copy_groups(const vector<SourceFile> &sources, bool assemble) {
+    vector<Segment> spans;
+    vector<size_t> order;
+    for (size_t i = 0; i < sources.size(); i++) {
+        spans.push_back(
+            output_span(vector<const SourceFile *>(1, &sources[i])));
+        order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return spans[a].output_start < spans[b].output_start;
+    });
+
+    vector<vector<const SourceFile *> > clusters, groups;
+    long end = -1;
+    for (size_t i : order) {
+        if (spans[i].count == 0) {
+            groups.push_back(vector<const SourceFile *>(1, &sources[i]));
+            continue;
+        }
+        if (clusters.empty() || (spans[i].output_start >= end)) {
+            clusters.push_back(vector<const SourceFile *>());
+        }
+        clusters.back().push_back(&sources[i]);
+        end = max(end, spans[i].output_start + spans[i].count);
+    }
+
+    for (auto &cluster : clusters) {
+        long covered = 0;
+        bool together = assemble && (cluster.size() > 1);
+        for (auto source : cluster) {
+            together = together && same_runs(source->aperture_runs,
+                                             cluster[0]->aperture_runs);
+            for (auto &segment : source->segments) {
+                covered += segment.count;
+            }
+        }
+        if (together && (covered == output_span(cluster).count)) {
+            groups.push_back(cluster);
             continue;
         }
+        for (auto source : cluster) {
+            groups.push_back(vector<const SourceFile *>(1, source));
+        }
+    }
+    return groups;
+}
+
+/* Whether the source IMAGELIST has exactly the output's columns, in the
+ * same order and with the same types and sizes. Variable length columns
+ * (negative types) point into the heap so are never raw copied. */
+bool FitsUpdater::sameImagelistLayout(const SourceFile &source) {
+    if (source.imagelist_order != imagelist_order) {
+        return false;
+    }
+    for (auto &name : imagelist_order) {
+        const ColumnDefinition &a = source.imagelist_columns.at(name);
+        const ColumnDefinition &b = imagelist_columns.at(name);
+        if ((a.type != b.type) || (a.type < 0) || (a.repeat != b.repeat) ||
+            (a.width != b.width)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Copy `nrows` rows of each of `columns` from the table `f` is positioned
+ * on into the current output table, converting to the output types */
+void FitsUpdater::copyColumns(FITSFile &f,
+                              const map<string, ColumnDefinition> &columns,
+                              long nrows, const vector<Segment> &rows) {
+    ::copyColumns(f, outfile, columns, nrows, rows, string_arena);
+}
 
-        switch (column.second.type) {
-        case TDOUBLE:
-            addToColumn<double>(f, outfile, nrows, currentImage, source_colnum,
-                                dest_colnum);
-            break;
-        case TFLOAT:
-            addToColumn<float>(f, outfile, nrows, currentImage, source_colnum,
-                               dest_colnum);
-            break;
-        case TINT:
-            addToColumn<int>(f, outfile, nrows, currentImage, source_colnum,
-                             dest_colnum);
-            break;
-        case TLONG:
-            addToColumn<long>(f, outfile, nrows, currentImage, source_colnum,
-                              dest_colnum);
-            break;
-        case TLONGLONG:
-            addToColumn<long>(f, outfile, nrows, currentImage, source_colnum,
-                              dest_colnum);
-            break;
-        case TLOGICAL:
-            addToBoolColumn(f, outfile, nrows, currentImage, source_colnum,
-                            dest_colnum);
-            break;
-        case TSTRING:
-            addToStringColumn(f, outfile, nrows, currentImage, source_colnum,
-                              dest_colnum, column.second);
-            break;
-        default:
-            log << "Not implemented: " << column.first << " "
-                 << column.second.type << endl;
-            break;
-        }
-    }
-}
-
-void FitsUpdater::updateImage(FITSFile &f, const string &image) {
-    outfile->toHDU(image);
+void FitsUpdater::updateImagelist(FITSFile &f, const SourceFile &source) {
+    PhaseTimer timer("imagelist", false);
+    outfile->toHDU(imagelist_hdu);
     outfile->check();
-    f.toHDU(image);
-    if (f.status == BAD_HDU_NUM) {
-        f.status = 0;
-        fits_clear_errmsg();
-    } else {
-        log << "Copying image " << image << " from " << f.filename << endl;
-        vector<double> imageData = f.readWholeImage();
-        outfile->writeImageSubset(imageData, currentImage,
-                                    f.imageDimensions());
+    f.toHDU(source.imagelist_hdu);
+    f.check();
+    long nrows = source.nimages;
+    for (auto &segment : source.segments) {
+        metrics.rows_copied += segment.count;
+    }
+
+    if (sameImagelistLayout(source) && (f.rowBytes() == outfile->rowBytes())) {
+        log << "Copying IMAGELIST rows from " << source.filename << endl;
+        copyTableRows(f, outfile, source.segments, tile_bytes);
+        return;
+    }
+
+    copyColumns(f, imagelist_columns, nrows, source.segments);
+}
+
+/* Read one tile at (image, aperture) of the source and queue its write to
+ * (out_image, out_aperture) of the output */
+template <typename T>
+void FitsUpdater::copyImageTile(FITSFile &f, const string &image,
+                                long image_index, long aperture,
+                                long out_image, long out_aperture,
+                                const ImageDimensions &block) {
+    vector<char> *buffer = pool->acquire();
+    T *pixels = (T *)&(*buffer)[0];
+    {
+        PhaseTimer timer("read", false);
+        f.readImageTile(pixels, image_index, aperture, block);
+    }
+    metrics.bytes_read +=
+        block.nimages * block.napertures * (long long)sizeof(T);
+    queueTile<T>(buffer, image, out_image, out_aperture, block);
+}
+
+/* Hand a filled pool buffer holding `block` of output image `image` to the
+ * writer, which returns it to the pool once written */
+template <typename T>
+void FitsUpdater::queueTile(vector<char> *buffer, const string &image,
+                            long out_image, long out_aperture,
+                            const ImageDimensions &block) {
+    int hdu = image_hdus[image];
+    int epoch_hdu = epoch_major ? epoch_major_hdus[image] : -1;
+    auto found = stats.find(image);
+    T *pixels = (T *)&(*buffer)[0];
+    long long nbytes = block.nimages * block.napertures * (long long)sizeof(T);
+
+    /* Statistics are taken on the reader so the single writer is left to
+     * write; readers copying the same image take turns */
+    if (found != stats.end()) {
+        PhaseTimer timer("stats", false);
+        lock_guard<mutex> lock(stats_locks.at(image));
+        found->second.add(pixels, out_aperture, block);
     }
+
+    writer->push([this, buffer, pixels, hdu, epoch_hdu, out_image,
+                  out_aperture, block, nbytes] {
+        PhaseTimer timer("write", false);
+        outfile->toHDU(hdu);
+        outfile->check();
+        outfile->writeImageTile(pixels, out_image, out_aperture, block);
+        metrics.bytes_written += nbytes;
+        metrics.pixels_copied += block.nimages * block.napertures;
+
+        if (epoch_major) {
+            T *transposed = (T *)&transpose_buffer[0];
+            transpose_block(pixels, transposed, block.napertures,
+                            block.nimages);
+            ImageDimensions flipped = {block.napertures, block.nimages};
+            epoch_major->toHDU(epoch_hdu);
+            epoch_major->check();
+            epoch_major->writeImageTile(transposed, out_aperture, out_image,
+                                        flipped);
+        }
+        pool->release(buffer);
+    });
 }
 
-void FitsUpdater::updateImages(FITSFile &f) {
+/* Copy the image HDU `f` is positioned on into the output image `image`,
+ * one segment of columns and run of apertures at a time, as pixels of type
+ * T. Tiles are read on the calling thread and handed to the writer. */
+template <typename T>
+void FitsUpdater::copyImageTiles(FITSFile &f, const string &image,
+                                 const vector<Segment> &segments,
+                                 const vector<Segment> &apertures) {
+    for (auto &segment : segments) {
+        ImageDimensions extent = {segment.count, dimensions.napertures};
+        ImageDimensions tile =
+            tileShape(extent, tile_bytes / (long)sizeof(T));
+
+        for (auto &run : apertures) {
+            for (long ap = 0; ap < run.count; ap += tile.napertures) {
+                for (long im = 0; im < segment.count; im += tile.nimages) {
+                    ImageDimensions block;
+                    block.nimages = min(tile.nimages, segment.count - im);
+                    block.napertures = min(tile.napertures, run.count - ap);
+                    copyImageTile<T>(f, image, segment.source_start + im,
+                                     run.source_start + ap,
+                                     segment.output_start + im,
+                                     run.output_start + ap, block);
+                }
+            }
+        }
+    }
+}
+
+/* Read the source epochs of `segments` that land in output columns
+ * [out_image, out_image + block.nimages) of a tile at source aperture
+ * `aperture`, and scatter them into the tile `pixels`. Source epochs are
+ * read a window of at most block.nimages at a time through `window`, so
+ * interleaved segments cost one read per window rather than one each. */
+template <typename T>
+static void scatter_source(FITSFile &f, const vector<Segment> &segments,
+                           long aperture, long out_image,
+                           const ImageDimensions &block, T *pixels,
+                           T *window) {
+    vector<Segment> pieces;
+    for (auto &segment : segments) {
+        long first = max(segment.output_start, out_image);
+        long last = min(segment.output_start + segment.count,
+                        out_image + block.nimages);
+        if (first < last) {
+            Segment piece = {segment.source_start + first -
+                                 segment.output_start,
+                             first, last - first};
+            pieces.push_back(piece);
+        }
+    }
+    sort(pieces.begin(), pieces.end(),
+         [](const Segment &a, const Segment &b) {
+             return a.source_start < b.source_start;
+         });
+
+    for (size_t p = 0; p < pieces.size();) {
+        long start = pieces[p].source_start, end = start;
+        size_t q = p;
+        while ((q < pieces.size()) &&
+               (pieces[q].source_start + pieces[q].count - start <=
+                block.nimages)) {
+            end = max(end, pieces[q].source_start + pieces[q].count);
+            q++;
+        }
+        ImageDimensions read = {end - start, block.napertures};
+        {
+            PhaseTimer timer("read", false);
+            f.readImageTile(window, start, aperture, read);
+        }
+        metrics.bytes_read +=
+            read.nimages * read.napertures * (long long)sizeof(T);
+
+        for (; p < q; p++) {
+            const Segment &piece = pieces[p];
+            for (long a = 0; a < block.napertures; a++) {
+                const T *from = window + a * read.nimages +
+                                (piece.source_start - start);
+                copy(from, from + piece.count,
+                     pixels + a * block.nimages +
+                         (piece.output_start - out_image));
+            }
+        }
+    }
+}
+
+/* Copy `image` from a group of interleaved sources (see copy_groups) one
+ * output tile at a time. Each tile is assembled in a pool buffer from every
+ * source that has the image, then written once. Sources without the image
+ * leave their epochs at zero, as they would be if copied on their own. */
+template <typename T>
+void FitsUpdater::assembleImageTiles(vector<shared_ptr<FITSFile> > &files,
+                                     const vector<const SourceFile *> &group,
+                                     const string &image,
+                                     vector<char> &scratch) {
+    const vector<Segment> &apertures = group[0]->aperture_runs;
+    Segment span = output_span(group);
+    ImageDimensions extent = {span.count, dimensions.napertures};
+    ImageDimensions tile = tileShape(extent, tile_bytes / (long)sizeof(T));
+    T *window = (T *)&scratch[0];
+
+    for (auto &run : apertures) {
+        for (long ap = 0; ap < run.count; ap += tile.napertures) {
+            for (long im = 0; im < span.count; im += tile.nimages) {
+                ImageDimensions block;
+                block.nimages = min(tile.nimages, span.count - im);
+                block.napertures = min(tile.napertures, run.count - ap);
+                long out_image = span.output_start + im;
+
+                vector<char> *buffer = pool->acquire();
+                T *pixels = (T *)&(*buffer)[0];
+                fill(pixels, pixels + block.nimages * block.napertures, T());
+                for (size_t i = 0; i < group.size(); i++) {
+                    auto hdu = group[i]->image_hdus.find(image);
+                    if (hdu == group[i]->image_hdus.end()) {
+                        continue;
+                    }
+                    files[i]->toHDU(hdu->second.index);
+                    files[i]->check();
+                    scatter_source(*files[i], group[i]->segments,
+                                   run.source_start + ap, out_image, block,
+                                   pixels, window);
+                }
+                queueTile<T>(buffer, image, out_image, run.output_start + ap,
+                             block);
+            }
+        }
+    }
+}
+
+/* Set the pixels of `image` at the output epochs of `segments` to NaN for
+ * the output apertures `source` does not have. Integer images have no NaN
+ * and are left at zero. */
+void FitsUpdater::fillMissing(const string &image, const SourceFile &source,
+                              const vector<Segment> &segments) {
+    int type = image_types[image];
+    if ((type != FLOAT_IMG) && (type != DOUBLE_IMG)) {
+        return;
+    }
+    vector<Segment> missing = missing_apertures(source, dimensions.napertures);
+    if (missing.empty()) {
+        return;
+    }
+    int hdu = image_hdus[image];
+    int epoch_hdu = epoch_major ? epoch_major_hdus[image] : -1;
+    for (auto &segment : segments) {
+        ImageDimensions extent = {segment.count, dimensions.napertures};
+        ImageDimensions tile = tileShape(extent, (long)nan_tile.size());
+        for (auto &run : missing) {
+            for (long ap = 0; ap < run.count; ap += tile.napertures) {
+                for (long im = 0; im < segment.count; im += tile.nimages) {
+                    ImageDimensions block;
+                    block.nimages = min(tile.nimages, segment.count - im);
+                    block.napertures = min(tile.napertures, run.count - ap);
+                    long out_image = segment.output_start + im;
+                    long out_aperture = run.output_start + ap;
+                    writer->push([this, hdu, epoch_hdu, out_image,
+                                  out_aperture, block] {
+                        PhaseTimer timer("write", false);
+                        outfile->toHDU(hdu);
+                        outfile->check();
+                        outfile->writeImageTile(&nan_tile[0], out_image,
+                                                out_aperture, block);
+                        if (epoch_major) {
+                            ImageDimensions flipped = {block.napertures,
+                                                       block.nimages};
+                            epoch_major->toHDU(epoch_hdu);
+                            epoch_major->check();
+                            epoch_major->writeImageTile(&nan_tile[0],
+                                                        out_aperture,
+                                                        out_image, flipped);
+                        }
+                    });
+                }
+            }
+        }
+    }
+}
+
+/* Copy at the output pixel type so that no precision is lost and narrow
+ * images are not widened to doubles on the way through */
+void FitsUpdater::updateImage(FITSFile &f, const string &image,
+                              const vector<Segment> &segments,
+                              const vector<Segment> &apertures) {
+    log << "Copying image " << image << " from " << f.filename << endl;
+    PhaseTimer timer("image", false);
+    switch (image_types[image]) {
+    case BYTE_IMG:
+        copyImageTiles<unsigned char>(f, image, segments,
+                                      apertures);
+        break;
+    case SBYTE_IMG:
+        copyImageTiles<signed char>(f, image, segments,
+                                    apertures);
+        break;
+    case SHORT_IMG:
+        copyImageTiles<short>(f, image, segments,
+                              apertures);
+        break;
+    case USHORT_IMG:
+        copyImageTiles<unsigned short>(f, image, segments,
+                                       apertures);
+        break;
+    case LONG_IMG:
+        copyImageTiles<int>(f, image, segments,
+                            apertures);
+        break;
+    case ULONG_IMG:
+        copyImageTiles<unsigned int>(f, image, segments,
+                                     apertures);
+        break;
+    case LONGLONG_IMG:
+        copyImageTiles<long long>(f, image, segments,
+                                  apertures);
+        break;
+    case FLOAT_IMG:
+        copyImageTiles<float>(f, image, segments,
+                              apertures);
+        break;
+    default:
+        copyImageTiles<double>(f, image, segments,
+                               apertures);
+        break;
+    }
+}
+
+void FitsUpdater::updateGroupImage(vector<shared_ptr<FITSFile> > &files,
+                                   const vector<const SourceFile *> &group,
+                                   const string &image,
+                                   vector<char> &scratch) {
+    log << "Copying image " << image << " from " << group.size()
+         << " interleaved files" << endl;
+    PhaseTimer timer("image", false);
+    switch (image_types[image]) {
+    case BYTE_IMG:
+        assembleImageTiles<unsigned char>(files, group, image, scratch);
+        break;
+    case SBYTE_IMG:
+        assembleImageTiles<signed char>(files, group, image, scratch);
+        break;
+    case SHORT_IMG:
+        assembleImageTiles<short>(files, group, image, scratch);
+        break;
+    case USHORT_IMG:
+        assembleImageTiles<unsigned short>(files, group, image, scratch);
+        break;
+    case LONG_IMG:
+        assembleImageTiles<int>(files, group, image, scratch);
+        break;
+    case ULONG_IMG:
+        assembleImageTiles<unsigned int>(files, group, image, scratch);
+        break;
+    case LONGLONG_IMG:
+        assembleImageTiles<long long>(files, group, image, scratch);
+        break;
+    case FLOAT_IMG:
+        assembleImageTiles<float>(files, group, image, scratch);
+        break;
+    default:
+        assembleImageTiles<double>(files, group, image, scratch);
+        break;
+    }
+}
+
+/* Raw copies need uncompressed data stored exactly as the output stores
+ * it, with the same number of apertures as the rest of the source */
+static bool rawCompatible(const ImageHDU &hdu, int image_type,
+                          const SourceFile &source) {
+    return !hdu.compressed && (equivalent_image_type(hdu) == image_type) &&
+           (hdu.bitpix == storage_bitpix(image_type)) &&
+           (hdu.dimensions.napertures == source.dimensions.napertures);
+}
+
+/* Copy the pixels of `segments` straight from the source file into the
+ * output, between the two maps or with a BulkCopier through a pool buffer.
+ * Each aperture row of a segment is one contiguous run of bytes on both
+ * sides, so no conversion or byte swapping is needed. */
+void FitsUpdater::rawCopyImage(const MappedFile &source_map,
+                               const ImageHDU &hdu, const string &image,
+                               const vector<Segment> &segments,
+                               const vector<Segment> &apertures) {
+    log << "Copying image " << image << " from " << source_map.filename
+         << " with " << options.io_backend << endl;
+    PhaseTimer timer("image." + options.io_backend, false);
+    const size_t pixel = imagePixelSize(image_types[image]);
+    const long src_stride = hdu.dimensions.nimages;
+    const long out_stride = dimensions.nimages;
+    if (hdu.datastart + hdu.dimensions.nimages * hdu.dimensions.napertures *
+                            pixel > source_map.size) {
+        throw runtime_error("Image " + image + " extends past the end of " +
+                            source_map.filename);
+    }
+
+    const long long out_start = raw_images.at(image);
+    vector<char> *buffer = NULL;
+    unique_ptr<BulkCopier> copier;
+    if (!output_map->data) {
+        buffer = pool->acquire();
+        copier.reset(create_bulk_copier(options.io_backend, &(*buffer)[0],
+                                        buffer->size(), options.io_depth));
+    }
+
+    for (auto &run : apertures) {
+        for (long ap = 0; ap < run.count; ap++) {
+            long src_ap = run.source_start + ap;
+            long out_ap = run.output_start + ap;
+            for (auto &segment : segments) {
+                long long src = hdu.datastart +
+                                (src_ap * src_stride + segment.source_start) *
+                                    (long long)pixel;
+                long long out = out_start +
+                                (out_ap * out_stride + segment.output_start) *
+                                    (long long)pixel;
+                if (copier) {
+                    copier->copy(source_map.fd, src, output_map->fd, out,
+                                 segment.count * pixel);
+                } else {
+                    memcpy(output_map->data + out, source_map.data + src,
+                           segment.count * pixel);
+                }
+            }
+        }
+    }
+    if (copier) {
+        copier->finish();
+        copier.reset();
+        pool->release(buffer);
+    }
+
+    long long npixels = 0;
+    for (auto &segment : segments) {
+        npixels += segment.count * dimensions.napertures;
+    }
+    metrics.pixels_copied += npixels;
+    metrics.bytes_read += npixels * pixel;
+    metrics.bytes_written += npixels * pixel;
+}
+
+void FitsUpdater::updateImages(FITSFile &f, const SourceFile &source) {
+    unique_ptr<MappedFile> source_map;
     for (auto image : image_names) {
-        updateImage(f, image);
+        auto hdu = source.image_hdus.find(image);
+        if (hdu == source.image_hdus.end()) {
+            continue;
+        }
+
+        if (raw_images.count(image)) {
+            if (!source_map) {
+                source_map.reset(new MappedFile(source.filename, false, 0,
+                                                output_map->data != NULL));
+            }
+            rawCopyImage(*source_map, hdu->second, image, source.segments,
+                         source.aperture_runs);
+            continue;
+        }
+
+        f.toHDU(hdu->second.index);
+        f.check();
+        updateImage(f, image, source.segments, source.aperture_runs);
+        fillMissing(image, source, source.segments);
     }
 }
 
-void FitsUpdater::updateCatalogue(FITSFile &f) {
+void FitsUpdater::updateCatalogue(FITSFile &f, const SourceFile &source) {
+    PhaseTimer timer("catalogue", false);
     int sourcecol = -1;
-    f.toHDU("CATALOGUE");
-    outfile->toHDU("CATALOGUE");
+    f.toHDU(source.catalogue_hdu);
+    f.check();
+    outfile->toHDU(catalogue_hdu);
+    outfile->check();
+
+    /* A subset or reordering of apertures only needs the matching rows */
+    const vector<Segment> &runs = source.catalogue_runs;
+    bool identity = (runs.size() == 1) && (runs[0].source_start == 0) &&
+                    (runs[0].output_start == 0) &&
+                    (runs[0].count == dimensions.napertures) &&
+                    (dimensions.napertures == source.dimensions.napertures);
+    if (!identity) {
+        log << "Copying catalogue rows from " << source.filename << endl;
+        copyColumns(f, catalogue_columns, source.dimensions.napertures, runs);
+        return;
+    }
+
     for (auto col : catalogue_columns) {
         log << "Updating catalogue column " << col.first << endl;
         fits_get_colnum(f.fptr, CASEINSEN, (char *)col.first.c_str(),
@@ -106,37 +633,417 @@ void FitsUpdater::updateCatalogue(FITSFile &f) {
     }
 }
 
-void FitsUpdater::render(const vector<string> &files, const string &output) {
-
+/* Create every output HDU up front so that each source file can be opened
+ * once and copied into all of them before moving on to the next */
+void FitsUpdater::allocateOutput(const string &output) {
     outfile = FITSFile::createFile(output);
 
-    log << "Updating catalogue from first file: " << files[0] << endl;
     outfile->addBinaryTable("CATALOGUE", catalogue_columns,
                             dimensions.napertures);
-    FITSFile first(files[0]);
-    updateCatalogue(first);
+    catalogue_hdu = outfile->hduIndex();
+    if (options.apertures.nshards > 0) {
+        /* Kept with the catalogue, which is copied as is when compressing */
+        fits_write_key(outfile->fptr, TINT, "SHARD",
+                       &options.apertures.shard, "Aperture shard index",
+                       &outfile->status);
+        fits_write_key(outfile->fptr, TINT, "NSHARDS",
+                       &options.apertures.nshards, "Number of shards",
+                       &outfile->status);
+        outfile->check();
+    }
+
+    outfile->addBinaryTable("IMAGELIST", imagelist_columns, dimensions.nimages,
+                            imagelist_order);
+    imagelist_hdu = outfile->hduIndex();
+
+    for (auto name : image_names) {
+        outfile->addImage(name, dimensions, image_types[name]);
+        image_hdus[name] = outfile->hduIndex();
+    }
+}
+
+/* Copy everything needed from one source file. Anything touching the
+ * output goes through the writer, so this may run on any reader thread.
+ * The tables are queued after the image tiles rather than waited for, so
+ * the reader moves straight on to the next file; whichever of the reader
+ * and writer finishes with the file last closes it. */
+void FitsUpdater::copySource(const SourceFile &source) {
+    log << "Updating from " << source.filename << endl;
+    shared_ptr<FITSFile> f(new FITSFile(source.filename));
+    updateImages(*f, source);
+    queueTables(f, source);
+}
+
+void FitsUpdater::queueTables(shared_ptr<FITSFile> f,
+                              const SourceFile &source) {
+    writer->push([this, f, &source] {
+        if (!source.catalogue_runs.empty()) {
+            log << "Updating catalogue from " << source.filename << endl;
+            updateCatalogue(*f, source);
+        }
+        updateImagelist(*f, source);
+    });
+}
+
+/* Copy one group from copy_groups. The images of an interleaved group are
+ * assembled a tile at a time from all of its files, with the apertures
+ * they lack filled across the whole span when every file has the image;
+ * the tables are still copied file by file. `scratch` holds one window of
+ * source epochs for scatter_source. */
+void FitsUpdater::copyGroup(const vector<const SourceFile *> &group) {
+    if (group.size() == 1) {
+        copySource(*group[0]);
+        return;
+    }
+    vector<shared_ptr<FITSFile> > files;
+    for (auto source : group) {
+        log << "Updating from " << source->filename << endl;
+        files.push_back(shared_ptr<FITSFile>(new FITSFile(source->filename)));
+    }
+    vector<char> scratch(tile_bytes);
+    vector<Segment> span(1, output_span(group));
+
+    for (auto &image : image_names) {
+        size_t nhaving = 0;
+        for (auto source : group) {
+            nhaving += source->image_hdus.count(image);
+        }
+        if (nhaving == 0) {
+            continue;
+        }
+        updateGroupImage(files, group, image, scratch);
+        for (auto source : group) {
+            if (nhaving == group.size()) {
+                fillMissing(image, *source, span);
+                break;
+            }
+            if (source->image_hdus.count(image)) {
+                fillMissing(image, *source, source->segments);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < group.size(); i++) {
+        queueTables(files[i], *group[i]);
+    }
+}
 
+/* Decide which output images can be filled by raw copies: those where every
+ * source that has the HDU stores it in the output's layout. Mixing raw and
+ * cfitsio writes within one HDU is never done, so cfitsio never holds a
+ * buffer covering raw-copied data. */
+void FitsUpdater::setupRawCopy(const vector<SourceFile> &sources,
+                               const string &output) {
+    raw_images.clear();
+    if (options.io_backend == "cfitsio") {
+        return;
+    }
 
-    log << "Updating imagelist" << endl;
-    outfile->addBinaryTable("IMAGELIST", imagelist_columns, dimensions.nimages);
-    for (auto filename : files) {
-        log << "Updating from " << filename << endl;
-        FITSFile source(filename);
-        updateImagelist(source);
-        currentImage += source.nimages();
+    /* Apertures missing from a file are filled with NaN by the writer */
+    for (auto &source : sources) {
+        if (!missing_apertures(source, dimensions.napertures).empty()) {
+            log << source.filename << " lacks some apertures, not copying "
+                   "with " << options.io_backend << endl;
+            return;
+        }
     }
 
-    log << "Reading in data from images" << endl;
+    LONGLONG file_end = 0;
     for (auto name : image_names) {
-        outfile->addImage(name, dimensions);
-        for (auto filename : files) {
-            FITSFile source(filename);
-            updateImage(source, name);
+        /* Statistics are taken from the tiles passing through the writer */
+        bool compatible = !stats.count(name);
+        for (auto &source : sources) {
+            auto hdu = source.image_hdus.find(name);
+            if ((hdu != source.image_hdus.end()) &&
+                !rawCompatible(hdu->second, image_types[name], source)) {
+                compatible = false;
+            }
+        }
+        if (!compatible) {
+            continue;
         }
+
+        LONGLONG headstart, datastart, dataend;
+        outfile->toHDU(image_hdus[name]);
+        outfile->check();
+        fits_get_hduaddrll(outfile->fptr, &headstart, &datastart, &dataend,
+                           &outfile->status);
+        outfile->check();
+        raw_images[name] = datastart;
+        file_end = max(file_end, dataend);
+    }
+
+    if (raw_images.empty()) {
+        return;
+    }
+    log << "Copying " << raw_images.size() << " image HDUs with "
+         << options.io_backend << endl;
+
+    /* Have cfitsio write out the full extent of the file itself; it would
+     * otherwise zero-fill anything past what it believes is the end of the
+     * file when it next writes there */
+    double zero = 0;
+    long lastpixel[] = {dimensions.nimages, dimensions.napertures};
+    outfile->toHDU(image_hdus[*image_names.rbegin()]);
+    outfile->check();
+    fits_write_pix(outfile->fptr, TDOUBLE, lastpixel, 1, &zero,
+                   &outfile->status);
+    outfile->check();
+    fits_flush_file(outfile->fptr, &outfile->status);
+    outfile->check();
+    /* A non-zero second argument also drops cfitsio's cached records */
+    fits_flush_buffer(outfile->fptr, 1, &outfile->status);
+    outfile->check();
+
+    output_map = new MappedFile(output, true, file_end,
+                                options.io_backend == "mmap");
+}
+
+/* Same images as the main output with the axes swapped: NAXIS1 is the
+ * aperture and NAXIS2 the epoch */
+void FitsUpdater::allocateEpochMajor(const string &output,
+                                     const string &main_output) {
+    log << "Writing epoch-major images to " << output << endl;
+    epoch_major = FITSFile::createFile(output);
+    fits_write_key(epoch_major->fptr, TSTRING, "MAINFILE",
+                   (char *)main_output.c_str(), "Stitched file transposed here",
+                   &epoch_major->status);
+    epoch_major->check();
+
+    for (auto name : image_names) {
+        epoch_major->addImage(name, dimensions.napertures, dimensions.nimages,
+                              image_types[name]);
+        epoch_major_hdus[name] = epoch_major->hduIndex();
+    }
+}
+
+/* Record where each source file and night landed in the output. Sources
+ * that are themselves stitched files contribute their own FILE entries, so
+ * the original files stay findable. */
+void FitsUpdater::writeIndex(const vector<SourceFile> &sources) {
+    vector<double> tmid = outfile->tmid();
+    vector<IndexEntry> entries;
+    for (auto &source : sources) {
+        vector<IndexEntry> files;
+        if (source.index_hdu >= 0) {
+            FITSFile f(source.filename);
+            for (auto &entry : read_index(f)) {
+                if (entry.type == "FILE") {
+                    files.push_back(entry);
+                }
+            }
+        } else {
+            IndexEntry whole;
+            whole.type = "FILE";
+            whole.name = source.filename;
+            whole.start = 0;
+            whole.stop = source.nimages;
+            files.push_back(whole);
+        }
+
+        for (auto &entry : files) {
+            if (map_entry(source.segments, tmid, entry)) {
+                entries.push_back(entry);
+            }
+        }
+    }
+    stable_sort(entries.begin(), entries.end(),
+                [](const IndexEntry &a, const IndexEntry &b) {
+                    return a.start < b.start;
+                });
+
+    vector<IndexEntry> nights = night_entries(tmid, options.night_gap);
+    log << "Indexing " << entries.size() << " files and " << nights.size()
+         << " nights" << endl;
+    entries.insert(entries.end(), nights.begin(), nights.end());
+    write_index_table(outfile, entries);
+}
+
+/* Image bytes the copy will write to the main output */
+long long FitsUpdater::expectedImageBytes(const vector<SourceFile> &sources) {
+    long long total = 0;
+    for (auto &source : sources) {
+        for (auto &hdu : source.image_hdus) {
+            if (!image_names.count(hdu.first)) {
+                continue;
+            }
+            long long nimages = 0, napertures = 0;
+            for (auto &segment : source.segments) {
+                nimages += segment.count;
+            }
+            for (auto &run : source.aperture_runs) {
+                napertures += run.count;
+            }
+            total += nimages * napertures *
+                     imagePixelSize(image_types[hdu.first]);
+        }
+    }
+    return total;
+}
+
+void FitsUpdater::render(const vector<SourceFile> &sources,
+                         const string &output) {
+    for (auto &name : options.stats_images) {
+        if (image_names.count(name)) {
+            stats[name] = ApertureStats(dimensions.napertures);
+            stats_locks[name];
+        } else {
+            log << "No image " << name << " to compute statistics of" << endl;
+        }
+    }
+    {
+        PhaseTimer timer("allocate");
+        allocateOutput(output);
+        if (options.epoch_major_output.empty()) {
+            setupRawCopy(sources, output);
+        } else {
+            /* Raw copies bypass the writer, where the transpose happens */
+            allocateEpochMajor(options.epoch_major_output, output);
+        }
+    }
+    PhaseTimer timer("copy");
+    metrics.bytes_expected = expectedImageBytes(sources);
+    ProgressReporter progress(options.progress);
+
+    /* Raw copies already move each segment as whole rows of bytes */
+    vector<vector<const SourceFile *> > groups =
+        copy_groups(sources, raw_images.empty());
+    int nthreads = max(1, min(options.threads, (int)groups.size()));
+    int prefetch = max(1, options.prefetch_buffers);
+    if (((nthreads > 1) || (prefetch > 1)) && !fits_is_reentrant()) {
+        log << "cfitsio is not built reentrant, reading and writing on one "
+               "thread" << endl;
+        nthreads = 1;
+        prefetch = 1;
+    }
+
+    /* Each reader can fill `prefetch` buffers ahead of the writer, which
+     * bounds the memory in flight. The writer's transpose buffer and NaN
+     * tile, and the readers' windows for interleaved groups, when needed,
+     * come out of the same budget. Buffers need be no larger than the
+     * largest source image. */
+    int nbuffers = nthreads * prefetch;
+    int nscratch = 0;
+    for (auto &group : groups) {
+        if (group.size() > 1) {
+            nscratch = nthreads;
+        }
+    }
+    bool missing = false;
+    long largest = 0;
+    for (auto &source : sources) {
+        largest = max(largest, source.dimensions.nimages *
+                                   source.dimensions.napertures *
+                                   (long)sizeof(double));
+        if (!missing_apertures(source, dimensions.napertures).empty()) {
+            missing = true;
+        }
+    }
+    int nwriter_buffers = (epoch_major ? 1 : 0) + (missing ? 1 : 0);
+    tile_bytes = max((long)sizeof(double),
+                     min(largest, options.max_buffer_bytes /
+                                      (nbuffers + nwriter_buffers +
+                                       nscratch)));
+
+    BufferPool buffers(nbuffers, tile_bytes);
+    if (epoch_major) {
+        transpose_buffer.resize(tile_bytes);
+    }
+    if (missing) {
+        nan_tile.assign(tile_bytes / (long)sizeof(double), NAN);
+    }
+    WriteQueue queue(nbuffers > 1);
+    pool = &buffers;
+    writer = &queue;
+
+    double write_before = metrics.phaseSeconds("write");
+    auto copy_start = chrono::steady_clock::now();
+
+    if (nbuffers == 1) {
+        for (size_t i = 0; i < groups.size(); i++) {
+            copyGroup(groups[i]);
+        }
+    } else {
+        log << "Reading with " << nthreads << " threads, " << nbuffers
+             << " buffers of " << tile_bytes << " bytes" << endl;
+        /* The first failure on any thread stops the rest: readers waiting
+         * for a buffer are woken by the abort and the writer skips what is
+         * left in its queue */
+        atomic<size_t> next(0);
+        mutex error_mutex;
+        exception_ptr reader_error;
+        queue.on_error = [&] { buffers.abort(); };
+        vector<thread> readers;
+        for (int t = 0; t < nthreads; t++) {
+            queue.addProducer();
+            readers.push_back(thread([&] {
+                try {
+                    size_t i;
+                    while ((i = next++) < groups.size()) {
+                        copyGroup(groups[i]);
+                    }
+                } catch (...) {
+                    lock_guard<mutex> lock(error_mutex);
+                    if (!reader_error) {
+                        reader_error = current_exception();
+                    }
+                    buffers.abort();
+                }
+                queue.removeProducer();
+            }));
+        }
+
+        queue.run();
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        if (queue.error) {
+            rethrow_exception(queue.error);
+        }
+        if (reader_error) {
+            rethrow_exception(reader_error);
+        }
+    }
+
+    /* There is one writer, so the time it was not busy writing is time
+     * the copy waited on reads; with reads fully hidden it is close to
+     * zero */
+    chrono::duration<double> wall = chrono::steady_clock::now() - copy_start;
+    double writing = metrics.phaseSeconds("write") - write_before;
+    double waiting = max(0., wall.count() - writing);
+    if (!options.shared_metrics) {
+        metrics.addPhase("write.idle", waiting);
+        log << "Writer busy " << writing << "s of " << wall.count()
+             << "s, waiting on reads for " << waiting << "s" << endl;
+    }
+
+    pool = NULL;
+    writer = NULL;
+    if (output_map) {
+        delete output_map;
+        output_map = NULL;
+    }
+    if (epoch_major) {
+        delete epoch_major;
+        epoch_major = NULL;
+    }
+
+    /* Appended once the raw copies are unmapped */
+    if (!stats.empty()) {
+        PhaseTimer timer("stats.table");
+        write_stats_table(outfile, stats, dimensions.napertures);
+    }
+    {
+        PhaseTimer timer("index");
+        writeIndex(sources);
     }
 }
 
+/* The mapped output and companion file are normally released at the end of
+ * render, but are still open here if it failed */
 FitsUpdater::~FitsUpdater() {
+    delete output_map;
+    delete epoch_major;
     if (outfile) {
         delete outfile;
     }
@@ -0,0 +1,205 @@
+#include "json.h"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+struct JsonParser {
+    explicit JsonParser(const string &text) : text(text), pos(0) {}
+
+    [[noreturn]] void fail(const string &message) {
+        stringstream ss;
+        ss << "Invalid JSON at offset " << pos << ": " << message;
+        throw runtime_error(ss.str());
+    }
+
+    void skipSpace() {
+        while ((pos < text.size()) && strchr(" \t\r\n", text[pos])) {
+            pos++;
+        }
+    }
+
+    char peek() {
+        skipSpace();
+        if (pos >= text.size()) {
+            fail("unexpected end of input");
+        }
+        return text[pos];
+    }
+
+    void expect(char c) {
+        if (peek() != c) {
+            fail(string("expected '") + c + "'");
+        }
+        pos++;
+    }
+
+    void literal(const char *word) {
+        size_t len = strlen(word);
+        if (text.compare(pos, len, word) != 0) {
+            fail(string("expected ") + word);
+        }
+        pos += len;
+    }
+
+    static void appendUtf8(string &out, unsigned long code) {
+        if (code < 0x80) {
+            out += (char)code;
+        } else if (code < 0x800) {
+            out += (char)(0xC0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3F));
+        } else {
+            out += (char)(0xE0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    string parseString() {
+        expect('"');
+        string out;
+        while (true) {
+            if (pos >= text.size()) {
+                fail("unterminated string");
+            }
+            char c = text[pos++];
+            if (c == '"') {
+                return out;
+            } else if (c != '\\') {
+                out += c;
+                continue;
+            }
+
+            if (pos >= text.size()) {
+                fail("unterminated escape");
+            }
+            char escape = text[pos++];
+            switch (escape) {
+            case '"':
+            case '\\':
+            case '/':
+                out += escape;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u': {
+                if (pos + 4 > text.size()) {
+                    fail("truncated \\u escape");
+                }
+                string hex = text.substr(pos, 4);
+                char *end = NULL;
+                unsigned long code = strtoul(hex.c_str(), &end, 16);
+                if (end != hex.c_str() + 4) {
+                    fail("invalid \\u escape");
+                }
+                appendUtf8(out, code);
+                pos += 4;
+                break;
+            }
+            default:
+                fail(string("invalid escape \\") + escape);
+            }
+        }
+    }
+
+    JsonValue parseValue() {
+        JsonValue out;
+        char c = peek();
+        if (c == '{') {
+            out.type = JsonValue::Object;
+            pos++;
+            if (peek() == '}') {
+                pos++;
+                return out;
+            }
+            while (true) {
+                string key = parseString();
+                expect(':');
+                out.object.push_back(make_pair(key, parseValue()));
+                if (peek() == ',') {
+                    pos++;
+                    continue;
+                }
+                expect('}');
+                return out;
+            }
+        } else if (c == '[') {
+            out.type = JsonValue::Array;
+            pos++;
+            if (peek() == ']') {
+                pos++;
+                return out;
+            }
+            while (true) {
+                out.array.push_back(parseValue());
+                if (peek() == ',') {
+                    pos++;
+                    continue;
+                }
+                expect(']');
+                return out;
+            }
+        } else if (c == '"') {
+            out.type = JsonValue::String;
+            out.string = parseString();
+        } else if (c == 't') {
+            literal("true");
+            out.type = JsonValue::Bool;
+            out.boolean = true;
+        } else if (c == 'f') {
+            literal("false");
+            out.type = JsonValue::Bool;
+        } else if (c == 'n') {
+            literal("null");
+        } else {
+            const char *start = text.c_str() + pos;
+            char *end = NULL;
+            out.number = strtod(start, &end);
+            if (end == start) {
+                fail("unexpected character");
+            }
+            out.type = JsonValue::Number;
+            pos += end - start;
+        }
+        return out;
+    }
+
+    const string &text;
+    size_t pos;
+};
+
+JsonValue parse_json(const string &text) {
+    JsonParser parser(text);
+    JsonValue out = parser.parseValue();
+    parser.skipSpace();
+    if (parser.pos != text.size()) {
+        parser.fail("trailing characters");
+    }
+    return out;
+}
+
+JsonValue read_json_file(const string &filename) {
+    ifstream in(filename.c_str());
+    if (!in) {
+        throw runtime_error("Cannot read " + filename);
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    return parse_json(ss.str());
+}
@@ -2,157 +2,460 @@
 #include <tclap/CmdLine.h>
 #include <fitsio.h>
 #include <stdexcept>
-#include <map>
-#include <set>
+#include <cstdio>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "fits_file.h"
+#include "aperture_selection.h"
+#include "bulk_io.h"
+#include "compress_output.h"
 #include "fits_updater.h"
+#include "json.h"
+#include "epoch_index.h"
+#include "binned_output.h"
+#include "manifest_cache.h"
+#include "merge_shards.h"
+#include "run_metrics.h"
+#include "stitch_plan.h"
 #include "time_utils.h"
 
 using namespace std;
 
-string toUpper(const string &s) {
-    string tmp = s;
-    for_each(tmp.begin(), tmp.end(),
-             [](char &c) { c = toupper((unsigned char)c); });
-    return tmp;
+/* Have `write` produce the output, through an uncompressed temporary file
+ * when compressing. The temporary is removed whether or not this succeeds. */
+static void write_output(const string &output, const StitchOptions &options,
+                         const function<void(const string &)> &write) {
+    if (!options.compression) {
+        write(output);
+        return;
+    }
+    string uncompressed = output + ".uncompressed.tmp";
+    try {
+        write(uncompressed);
+        PhaseTimer timer("compress");
+        compress_file(uncompressed, output, options);
+    } catch (...) {
+        remove(uncompressed.c_str());
+        throw;
+    }
+    remove(uncompressed.c_str());
 }
 
-ImageDimensions get_image_dimensions(const vector<string> &files) {
-    ImageDimensions out = {0, 0};
+/* `cache`, if given, is used instead of loading options.manifest_cache and
+ * is left for the caller to save */
+void stitch(const vector<string> &files, const string &output,
+            const StitchOptions &options, ManifestCache *cache = NULL) {
+    PhaseTimer total("stitch");
 
-    for (auto filename : files) {
-        FITSFile source(filename);
-        source.toHDU("FLUX");
-        ImageDimensions dim = source.imageDimensions();
-        if ((out.napertures == 0) && (out.nimages == 0)) {
-            out.napertures = dim.napertures;
-            out.nimages = dim.nimages;
+    StitchPlan plan;
+    {
+        PhaseTimer timer("plan");
+        if (cache || options.manifest_cache.empty()) {
+            plan = build_plan(files, cache, options.window,
+                              options.frame_filter);
         } else {
-            if (dim.napertures != out.napertures) {
-                throw runtime_error("Image dimensions do not match");
-            }
+            ManifestCache cache(options.manifest_cache);
+            plan = build_plan(files, &cache, options.window,
+                              options.frame_filter);
+            cache.save();
+        }
 
-            out.nimages += dim.nimages;
+        if (!options.aperture_match.empty()) {
+            if (!options.apertures.empty()) {
+                throw runtime_error("Cannot select apertures while matching "
+                                    "them across files");
+            }
+            match_apertures(plan, options.aperture_key,
+                            options.aperture_match == "intersection");
+        } else {
+            check_same_apertures(plan);
+        }
+        if (!options.apertures.empty()) {
+            restrict_apertures(
+                plan, select_apertures(options.apertures, plan.sources[0]));
         }
     }
 
-    return out;
-}
+    log << "Image dimensions => nimages: " << plan.dimensions.nimages
+         << ", napertures: " << plan.dimensions.napertures << endl;
 
-map<string, ColumnDefinition> get_columns(const vector<string> &files,
-                                          const string &hduname) {
-    map<string, ColumnDefinition> out;
-    for (auto filename : files) {
-        FITSFile source(filename);
-        source.toHDU(toUpper(hduname));
-
-        auto column_description = source.column_description();
-
-        for (auto column : column_description) {
-            if (out.find(column.first) == out.end()) {
-                out.insert(column);
-            } else {
-                int new_type = column.second.type;
-                int old_type = out[column.first].type;
-                if (new_type > old_type) {
-                    out[column.first] = column.second;
-                }
-            }
+    /* Compressed output is written from a complete uncompressed file */
+    write_output(output, options, [&](const string &stitched) {
+        PhaseTimer timer("render");
+        if (options.bin_minutes > 0) {
+            write_binned(plan, stitched, options);
+        } else {
+            FitsUpdater updater(plan, options);
+            updater.render(plan.sources, stitched);
         }
+    });
+
+    if (options.shared_metrics) {
+        log << "Complete" << endl;
+    } else {
+        log << "Complete, opened " << FITSFile::nopened << " files, peak RSS "
+            << peak_rss_kb() / 1024 << " MB" << endl;
     }
-    return out;
 }
 
-/* Macro for set inclusion */
-#define in_set(V, S) ((S).find((V)) != (S).end())
-
-vector<string> sort_files_by_mjd_range(const vector<string> &files) {
-    auto tmp = files;
-    sort(tmp.begin(), tmp.end(), [](const string &a, const string &b) -> bool {
-        double a_min = FITSFile(a).mjd_range().min;
-        double b_min = FITSFile(b).mjd_range().min;
-        return a_min < b_min;
+void merge(const vector<string> &shards, const string &output,
+           const StitchOptions &options) {
+    write_output(output, options, [&](const string &merged) {
+        merge_shards(shards, merged, options);
     });
-    return files;
+    log << "Complete, opened " << FITSFile::nopened << " files" << endl;
 }
 
-set<string> get_image_names(const vector<string> &files) {
-    set<string> out;
-    set<string> to_skip;
-
-    /* Build skip list */
-    for (int i = 1; i < 14; i++) {
-        if (i != 2) {
-            stringstream ss;
-            ss << "FLUX_" << i;
-            to_skip.insert(ss.str());
-            ss.str("");
-            ss << "ERROR_" << i;
-            to_skip.insert(ss.str());
-        }
+/* Stitch every field/camera of a mapping file written by stitch_all.py,
+ * {"field@camera": [files...]}, into <output_dir>/field-camera.fits. Fields
+ * are shared between `jobs` workers, which share one manifest cache saved
+ * at the end. A field that fails is reported and the rest carry on;
+ * returns the number of failures. */
+int batch(const string &mapping_file, const string &output_dir,
+          const StitchOptions &options, int jobs) {
+    JsonValue mapping = read_json_file(mapping_file);
+    if (mapping.type != JsonValue::Object) {
+        throw runtime_error(mapping_file + " is not a field mapping");
     }
 
-    for (auto filename : files) {
-        int nhdu = -1;
-        FITSFile source(filename);
-        fits_get_num_hdus(source.fptr, &nhdu, &source.status);
-        source.check();
-
-        for (int i = 2; i < nhdu; i++) {
-            char buf[FLEN_VALUE];
-            source.toHDU(i);
-            int hdutype = -1;
-            fits_get_hdu_type(source.fptr, &hdutype, &source.status);
-            source.check();
-            if (hdutype == IMAGE_HDU) {
-                fits_read_key(source.fptr, TSTRING, "EXTNAME", buf, NULL,
-                              &source.status);
-                source.check();
-
-                if (!in_set(buf, to_skip)) {
-                    out.insert(buf);
-                }
+    vector<pair<string, vector<string>>> fields;
+    for (auto &entry : mapping.object) {
+        string name = entry.first;
+        replace(name.begin(), name.end(), '@', '-');
+        if (entry.second.type != JsonValue::Array) {
+            throw runtime_error("Field " + entry.first + " of " +
+                                mapping_file + " is not a list of files");
+        }
+        vector<string> files;
+        for (auto &file : entry.second.array) {
+            if (file.type != JsonValue::String) {
+                throw runtime_error("Field " + entry.first + " of " +
+                                    mapping_file + " has a non-string file");
             }
+            files.push_back(file.string);
         }
+        sort(files.begin(), files.end());
+        fields.push_back(make_pair(name, files));
     }
 
-    return out;
-}
+    jobs = max(1, min(jobs, (int)fields.size()));
+    if ((jobs > 1) && !fits_is_reentrant()) {
+        log << "cfitsio is not built reentrant, stitching one field at a time"
+             << endl;
+        jobs = 1;
+    }
+    log << "Stitching " << fields.size() << " fields with " << jobs
+         << " workers" << endl;
+
+    unique_ptr<ManifestCache> cache;
+    if (!options.manifest_cache.empty()) {
+        cache.reset(new ManifestCache(options.manifest_cache));
+    }
+    StitchOptions field_options = options;
+    if (jobs > 1) {
+        field_options.shared_metrics = true;
+        field_options.progress = false;
+    }
+
+    atomic<size_t> next(0);
+    mutex failures_mutex;
+    vector<string> failures;
+    auto worker = [&] {
+        size_t i;
+        while ((i = next++) < fields.size()) {
+            const string &name = fields[i].first;
+            string output = output_dir + "/" + name + ".fits";
+            try {
+                log << "Field " << name << ": " << fields[i].second.size()
+                     << " files to " << output << endl;
+                stitch(fields[i].second, output, field_options, cache.get());
+            } catch (const exception &e) {
+                log << "Field " << name << " failed: " << e.what() << endl;
+                lock_guard<mutex> lock(failures_mutex);
+                failures.push_back(name);
+            }
+        }
+    };
 
-void stitch(const vector<string> &files, const string &output) {
-    log << "Sorting files by mjd" << endl;
-    auto sorted_files = sort_files_by_mjd_range(files);
+    vector<thread> workers;
+    for (int j = 1; j < jobs; j++) {
+        workers.push_back(thread(worker));
+    }
+    worker();
+    for (auto &t : workers) {
+        t.join();
+    }
 
-    log << "Fetching image dimensions" << endl;
-    auto image_dimensions = get_image_dimensions(sorted_files);
+    if (cache) {
+        cache->save();
+    }
+    log << "Stitched " << fields.size() - failures.size() << " of "
+         << fields.size() << " fields, opened " << FITSFile::nopened
+         << " files, peak RSS " << peak_rss_kb() / 1024 << " MB" << endl;
+    for (auto &name : failures) {
+        log << "Failed: " << name << endl;
+    }
+    return failures.size();
+}
 
-    log << "Image dimensions => nimages: " << image_dimensions.nimages
-         << ", napertures: " << image_dimensions.napertures << endl;
-    auto imagelist_columns = get_columns(sorted_files, "IMAGELIST");
-    auto catalogue_columns = get_columns(sorted_files, "CATALOGUE");
-    set<string> image_names = get_image_names(sorted_files);
+int compression_algorithm(const string &name) {
+    if (name == "rice") {
+        return RICE_1;
+    } else if (name == "gzip") {
+        return GZIP_1;
+    } else if (name == "gzip2") {
+        return GZIP_2;
+    } else if (name.empty() || (name == "none")) {
+        return 0;
+    }
+    throw runtime_error("Unknown compression algorithm " + name);
+}
 
-    FitsUpdater updater(image_dimensions, imagelist_columns, catalogue_columns,
-                        image_names);
-    updater.render(files, output);
-    log << "Complete" << endl;
+/* --metrics-json is written however the run ends, with its exit status
+ * and any error, as failed runs are the ones most worth timing */
+static int finish(const string &metrics_file, int status,
+                  const string &error) {
+    if (!metrics_file.empty()) {
+        try {
+            metrics.writeJSON(metrics_file, status, error);
+        } catch (const exception &e) {
+            cerr << "error: " << e.what() << endl;
+            return 1;
+        }
+    }
+    return status;
 }
 
 int main(int argc, char *argv[]) {
+    string metrics_file;
     try {
         TCLAP::CmdLine cmd("zlp-stitch", ' ', "0.0.1");
-        TCLAP::ValueArg<string> output_arg("o", "output", "output file", true,
-                                           "", "FILE", cmd);
+        TCLAP::ValueArg<string> output_arg(
+            "o", "output", "output file, or directory with --batch", false, "",
+            "FILE", cmd);
+        TCLAP::ValueArg<long> max_buffer_arg(
+            "", "max-buffer-mb",
+            "upper bound on the image copy buffer in MB (default 256)", false,
+            256, "MB", cmd);
+        TCLAP::ValueArg<int> threads_arg(
+            "", "threads", "number of threads reading source files", false, 1,
+            "N", cmd);
+        TCLAP::ValueArg<int> prefetch_arg(
+            "", "prefetch",
+            "image buffers each reader fills ahead of the writer; 1 reads "
+            "and writes in turn (default 2)",
+            false, 2, "N", cmd);
+        TCLAP::ValueArg<string> cache_arg(
+            "", "cache", "manifest cache of source file headers", false, "",
+            "FILE", cmd);
+        TCLAP::SwitchArg no_mmap_arg(
+            "", "no-mmap", "same as --io-backend cfitsio", cmd);
+        TCLAP::ValueArg<string> io_backend_arg(
+            "", "io-backend",
+            "copy images with matching layout with mmap, pread, uring (if "
+            "built with liburing) or only through cfitsio",
+            false, "mmap", "BACKEND", cmd);
+        TCLAP::ValueArg<int> io_depth_arg(
+            "", "io-depth", "requests in flight with --io-backend uring",
+            false, 4, "N", cmd);
+        TCLAP::ValueArg<string> compress_arg(
+            "", "compress",
+            "tile compress output images: rice, gzip or gzip2", false, "",
+            "ALGORITHM", cmd);
+        TCLAP::ValueArg<float> quantize_arg(
+            "", "quantize",
+            "quantisation level for compressed floating point images "
+            "(default 0, lossless)",
+            false, 0, "Q", cmd);
+        TCLAP::ValueArg<string> epoch_major_arg(
+            "", "epoch-major",
+            "also write every image transposed, one epoch per row, to FILE",
+            false, "", "FILE", cmd);
+        TCLAP::ValueArg<double> mjd_min_arg(
+            "", "mjd-min", "only copy epochs with TMID of at least MJD", false,
+            all_mjds().min, "MJD", cmd);
+        TCLAP::ValueArg<double> mjd_max_arg(
+            "", "mjd-max", "only copy epochs with TMID of at most MJD", false,
+            all_mjds().max, "MJD", cmd);
+        TCLAP::ValueArg<string> filter_arg(
+            "", "filter",
+            "only copy epochs whose IMAGELIST row matches a cfitsio row "
+            "filter, e.g. \"CLOUDS < 0.75 && SHIFT <= 3\"",
+            false, "", "EXPR", cmd);
+        TCLAP::ValueArg<double> bin_arg(
+            "", "bin-minutes",
+            "write epochs averaged into bins of MIN minutes, FLUX weighted "
+            "by FLUXERR",
+            false, 0, "MIN", cmd);
+        TCLAP::ValueArg<string> apertures_arg(
+            "", "apertures",
+            "only copy these aperture indices, e.g. 0,5,10-20", false, "",
+            "LIST", cmd);
+        TCLAP::ValueArg<string> aperture_ids_arg(
+            "", "aperture-ids", "only copy apertures with OBJ_IDs in FILE",
+            false, "", "FILE", cmd);
+        TCLAP::ValueArg<string> aperture_filter_arg(
+            "", "aperture-filter",
+            "only copy apertures whose CATALOGUE row matches a cfitsio row "
+            "filter, e.g. \"FLUX_MEAN > 1000\"",
+            false, "", "EXPR", cmd);
+        TCLAP::ValueArg<string> match_arg(
+            "", "match-apertures",
+            "match apertures across files by --aperture-key, keeping their "
+            "union (NaN where a file lacks one) or intersection",
+            false, "", "union|intersection", cmd);
+        TCLAP::ValueArg<string> aperture_key_arg(
+            "", "aperture-key",
+            "CATALOGUE column identifying apertures for --match-apertures",
+            false, "OBJ_ID", "COLUMN", cmd);
+        TCLAP::ValueArg<string> shard_arg(
+            "", "shard",
+            "only copy the i-th of N equal aperture ranges, to be combined "
+            "with --merge-shards",
+            false, "", "i/N", cmd);
+        TCLAP::SwitchArg merge_shards_arg(
+            "", "merge-shards",
+            "combine the outputs of --shard runs given as the files", cmd);
+        TCLAP::ValueArg<string> batch_arg(
+            "", "batch",
+            "stitch every field in a stitch_all.py mapping JSON file", false,
+            "", "FILE", cmd);
+        TCLAP::ValueArg<int> jobs_arg(
+            "", "jobs", "fields stitched at once with --batch", false, 1, "N",
+            cmd);
+        TCLAP::ValueArg<string> metrics_arg(
+            "", "metrics-json", "write run metrics as JSON to FILE at exit",
+            false, "", "FILE", cmd);
+        TCLAP::MultiArg<string> stats_arg(
+            "", "stats",
+            "write per-aperture statistics of IMAGE to a STATS table", false,
+            "IMAGE", cmd);
+        TCLAP::ValueArg<double> night_gap_arg(
+            "", "night-gap",
+            "gap between epochs in days that starts a new night in the INDEX "
+            "(default 0.25)",
+            false, 0.25, "DAYS", cmd);
+        TCLAP::SwitchArg list_index_arg(
+            "", "list-index", "print the INDEX table of the given file", cmd);
+        TCLAP::ValueArg<string> slice_arg(
+            "", "slice",
+            "write the epochs of one night (YYYY-MM-DD) or source file in the "
+            "INDEX of the given file to the output",
+            false, "", "NAME", cmd);
+        TCLAP::SwitchArg progress_arg(
+            "", "progress", "show copy throughput and ETA on stderr", cmd);
         TCLAP::UnlabeledMultiArg<string> filename_arg(
-            "filename", "file to analyse", true, "FILE", cmd);
+            "filename", "file to analyse", false, "FILE", cmd);
         cmd.parse(argc, argv);
+        metrics_file = metrics_arg.getValue();
+
+        StitchOptions options;
+        options.max_buffer_bytes = max_buffer_arg.getValue() * 1024L * 1024L;
+        options.threads = threads_arg.getValue();
+        options.prefetch_buffers = prefetch_arg.getValue();
+        options.manifest_cache = cache_arg.getValue();
+        options.io_backend =
+            no_mmap_arg.getValue() ? "cfitsio" : io_backend_arg.getValue();
+        options.io_depth = io_depth_arg.getValue();
+        if ((options.io_backend != "mmap") &&
+            (options.io_backend != "cfitsio") &&
+            !bulk_backend_available(options.io_backend)) {
+            throw runtime_error("I/O backend " + options.io_backend +
+                                " is not available");
+        }
+        options.compression = compression_algorithm(compress_arg.getValue());
+        options.quantize_level = quantize_arg.getValue();
+        options.epoch_major_output = epoch_major_arg.getValue();
+        options.progress = progress_arg.getValue();
+        options.stats_images = stats_arg.getValue();
+        options.night_gap = night_gap_arg.getValue();
+        options.window.min = mjd_min_arg.getValue();
+        options.window.max = mjd_max_arg.getValue();
+        options.frame_filter = filter_arg.getValue();
+        options.bin_minutes = bin_arg.getValue();
+        if (options.bin_minutes > 0) {
+            /* Binned output is averaged and written on one thread, without
+             * the tile copy that these options configure */
+            string unsupported;
+            if (!options.stats_images.empty()) {
+                unsupported = "--stats";
+            } else if (!options.epoch_major_output.empty()) {
+                unsupported = "--epoch-major";
+            } else if (threads_arg.isSet()) {
+                unsupported = "--threads";
+            } else if (prefetch_arg.isSet()) {
+                unsupported = "--prefetch";
+            } else if (io_backend_arg.isSet() || no_mmap_arg.isSet() ||
+                       io_depth_arg.isSet()) {
+                unsupported = "--io-backend";
+            }
+            if (!unsupported.empty()) {
+                throw runtime_error("Cannot use " + unsupported +
+                                    " with --bin-minutes");
+            }
+        }
+        options.apertures.indices = apertures_arg.getValue();
+        options.apertures.ids_file = aperture_ids_arg.getValue();
+        options.apertures.filter = aperture_filter_arg.getValue();
+        options.aperture_match = match_arg.getValue();
+        if (!options.aperture_match.empty() &&
+            (options.aperture_match != "union") &&
+            (options.aperture_match != "intersection")) {
+            throw runtime_error("Unknown aperture matching " +
+                                options.aperture_match);
+        }
+        options.aperture_key = aperture_key_arg.getValue();
+        if (!shard_arg.getValue().empty()) {
+            parse_shard(shard_arg.getValue(), options.apertures);
+        }
+
+        const vector<string> &files = filename_arg.getValue();
+        const string &output = output_arg.getValue();
+        bool listing = list_index_arg.getValue();
+        if (output.empty() && !listing) {
+            cerr << "error: no output given with -o" << endl;
+            return 1;
+        }
+        if ((listing || !slice_arg.getValue().empty()) &&
+            (files.size() != 1)) {
+            cerr << "error: give exactly one stitched file to read" << endl;
+            return 1;
+        }
 
-        stitch(filename_arg.getValue(), output_arg.getValue());
+        int status = 0;
+        string error;
+        if (listing) {
+            print_index(files[0]);
+        } else if (!slice_arg.getValue().empty()) {
+            extract_slice(files[0], slice_arg.getValue(), output,
+                          options.max_buffer_bytes);
+        } else if (!batch_arg.getValue().empty()) {
+            int failures = batch(batch_arg.getValue(), output, options,
+                                 jobs_arg.getValue());
+            if (failures > 0) {
+                status = 1;
+                error = to_string(failures) + " fields failed";
+            }
+        } else if (files.empty()) {
+            cerr << "error: no input files given" << endl;
+            return 1;
+        } else if (merge_shards_arg.getValue()) {
+            merge(files, output, options);
+        } else {
+            stitch(files, output, options);
+        }
 
-        return 0;
+        return finish(metrics_file, status, error);
     } catch (TCLAP::ArgException &e) {
         cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+    } catch (const exception &e) {
+        cerr << "error: " << e.what() << endl;
+        return finish(metrics_file, 1, e.what());
     }
+    return 1;
 }
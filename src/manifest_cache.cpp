@@ -0,0 +1,212 @@
+#include "manifest_cache.h"
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <cstdio>
+#include <sys/stat.h>
+
+#include "time_utils.h"
+
+using namespace std;
+
+/* Bump whenever the layout of SourceFile, and so of the file, changes */
+static const int manifest_version = 6;
+static const string manifest_magic = "zlp-stitch-manifest";
+
+/* Strings are written length-prefixed so that they may contain spaces */
+static void write_string(ostream &out, const string &s) {
+    out << s.size() << ":" << s;
+}
+
+static bool read_string(istream &in, string &s) {
+    size_t len = 0;
+    char sep = 0;
+    if (!(in >> len) || !in.get(sep) || (sep != ':')) {
+        return false;
+    }
+    s.resize(len);
+    return len == 0 || in.read(&s[0], len);
+}
+
+static void write_column(ostream &out, const string &tag, const string &name,
+                         const ColumnDefinition &def) {
+    out << tag << " ";
+    write_string(out, name);
+    out << " " << def.type << " " << def.repeat << " " << def.width << "\n";
+}
+
+static bool stat_file(const string &filename, long long &size,
+                      long long &mtime, long long &mtime_ns) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+    mtime = st.st_mtim.tv_sec;
+    mtime_ns = st.st_mtim.tv_nsec;
+    return true;
+}
+
+ManifestCache::ManifestCache(const string &filename)
+    : filename(filename), hits(0), misses(0) {
+    ifstream in(filename.c_str());
+    if (!in) {
+        return;
+    }
+
+    string magic;
+    int version = -1;
+    if (!(in >> magic >> version) || (magic != manifest_magic) ||
+        (version != manifest_version)) {
+        log << "Ignoring incompatible manifest cache " << filename << endl;
+        return;
+    }
+
+    Entry entry;
+    string path, tag;
+    bool in_entry = false;
+    while (in >> tag) {
+        bool ok = true;
+        SourceFile &source = entry.source;
+        if (tag == "file") {
+            entry = Entry();
+            ok = read_string(in, path) &&
+                 (in >> entry.size >> entry.mtime >> entry.mtime_ns);
+            source.filename = path;
+            in_entry = ok;
+        } else if (!in_entry) {
+            ok = false;
+        } else if (tag == "dims") {
+            ok = bool(in >> source.dimensions.nimages >>
+                      source.dimensions.napertures >> source.nimages);
+        } else if (tag == "mjd") {
+            ok = bool(in >> source.mjd.min >> source.mjd.max);
+        } else if (tag == "sorted") {
+            ok = bool(in >> source.sorted);
+        } else if (tag == "hdus") {
+            ok = bool(in >> source.catalogue_hdu >> source.imagelist_hdu >>
+                      source.index_hdu);
+        } else if (tag == "image") {
+            string name;
+            ImageHDU hdu;
+            ok = read_string(in, name) &&
+                 (in >> hdu.index >> hdu.bitpix >> hdu.bscale >> hdu.bzero >>
+                  hdu.compressed >> hdu.dimensions.nimages >>
+                  hdu.dimensions.napertures >> hdu.datastart);
+            source.image_hdus[name] = hdu;
+        } else if ((tag == "imagelist") || (tag == "catalogue")) {
+            string name;
+            ColumnDefinition def;
+            ok = read_string(in, name) &&
+                 (in >> def.type >> def.repeat >> def.width);
+            if (tag == "imagelist") {
+                source.imagelist_columns[name] = def;
+                source.imagelist_order.push_back(name);
+            } else {
+                source.catalogue_columns[name] = def;
+            }
+        } else if (tag == "end") {
+            entries[path] = entry;
+            in_entry = false;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            log << "Manifest cache " << filename
+                 << " is corrupt, ignoring the rest of it" << endl;
+            break;
+        }
+    }
+
+    log << "Loaded " << entries.size() << " entries from manifest cache "
+         << filename << endl;
+}
+
+SourceFile ManifestCache::describe(const string &path, bool *hit) {
+    long long size = -1, mtime = -1, mtime_ns = -1;
+    bool exists = stat_file(path, size, mtime, mtime_ns);
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(path);
+        bool fresh = exists && (entry != entries.end()) &&
+                     (entry->second.size == size) &&
+                     (entry->second.mtime == mtime) &&
+                     (entry->second.mtime_ns == mtime_ns);
+        if (hit) {
+            *hit = fresh;
+        }
+        if (fresh) {
+            hits++;
+            return entry->second.source;
+        }
+        misses++;
+    }
+
+    Entry fresh;
+    fresh.size = size;
+    fresh.mtime = mtime;
+    fresh.mtime_ns = mtime_ns;
+    fresh.source = describe_source(path);
+    lock_guard<std::mutex> lock(mutex);
+    entries[path] = fresh;
+    return fresh.source;
+}
+
+/* Written to a temporary file and renamed into place, so that a run killed
+ * while saving never leaves a truncated cache behind */
+void ManifestCache::save() {
+    lock_guard<std::mutex> lock(mutex);
+    string tmpname = filename + ".tmp";
+    {
+        ofstream out(tmpname.c_str());
+        out.precision(numeric_limits<double>::max_digits10);
+        out << manifest_magic << " " << manifest_version << "\n";
+        for (auto &item : entries) {
+            const Entry &entry = item.second;
+            const SourceFile &source = entry.source;
+            out << "file ";
+            write_string(out, item.first);
+            out << " " << entry.size << " " << entry.mtime << " "
+                << entry.mtime_ns << "\n";
+            out << "dims " << source.dimensions.nimages << " "
+                << source.dimensions.napertures << " " << source.nimages
+                << "\n";
+            out << "mjd " << source.mjd.min << " " << source.mjd.max << "\n";
+            out << "sorted " << source.sorted << "\n";
+            out << "hdus " << source.catalogue_hdu << " "
+                << source.imagelist_hdu << " " << source.index_hdu << "\n";
+            for (auto &image : source.image_hdus) {
+                const ImageHDU &hdu = image.second;
+                out << "image ";
+                write_string(out, image.first);
+                out << " " << hdu.index << " " << hdu.bitpix << " "
+                    << hdu.bscale << " " << hdu.bzero << " " << hdu.compressed
+                    << " " << hdu.dimensions.nimages << " "
+                    << hdu.dimensions.napertures << " " << hdu.datastart
+                    << "\n";
+            }
+            /* IMAGELIST columns are written in file order, which is how
+             * imagelist_order is rebuilt when loading */
+            for (auto &name : source.imagelist_order) {
+                write_column(out, "imagelist", name,
+                             source.imagelist_columns.at(name));
+            }
+            for (auto &column : source.catalogue_columns) {
+                write_column(out, "catalogue", column.first, column.second);
+            }
+            out << "end\n";
+        }
+
+        if (!out) {
+            log << "Cannot write manifest cache " << tmpname << endl;
+            return;
+        }
+    }
+
+    if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+        log << "Cannot move manifest cache into place at " << filename
+             << endl;
+    }
+}
@@ -0,0 +1,67 @@
+#include "mapped_file.h"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static runtime_error mapping_error(const string &what, const string &filename) {
+    return runtime_error("Cannot " + what + " " + filename + ": " +
+                         strerror(errno));
+}
+
+MappedFile::MappedFile(const string &filename, bool writable, size_t size,
+                       bool map)
+    : filename(filename), data(NULL), size(0), fd(-1) {
+    fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        throw mapping_error("open", filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw mapping_error("stat", filename);
+    }
+
+    this->size = st.st_size;
+    if (writable && (this->size < size)) {
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            throw mapping_error("extend", filename);
+        }
+        this->size = size;
+    }
+
+    if (!map) {
+        if (!writable) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return;
+    }
+
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *mapped = mmap(NULL, this->size, prot, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        throw mapping_error("map", filename);
+    }
+    data = (char *)mapped;
+
+    if (!writable) {
+        madvise(data, this->size, MADV_SEQUENTIAL);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (data) {
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
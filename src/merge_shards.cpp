@@ -0,0 +1,176 @@
+#include "merge_shards.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include "fits_file.h"
+#include "time_utils.h"
+
+using namespace std;
+
+struct Shard {
+    unique_ptr<FITSFile> file;
+    int index, nshards;
+    long napertures, nimages;
+    std::vector<double> tmid;
+};
+
+static void describe_shard(const string &filename, Shard &shard) {
+    shard.file.reset(new FITSFile(filename));
+    FITSFile &f = *shard.file;
+    f.toHDU("CATALOGUE");
+    f.check();
+    shard.index = f.readKey("SHARD", -1);
+    shard.nshards = f.readKey("NSHARDS", -1);
+    fits_get_num_rows(f.fptr, &shard.napertures, &f.status);
+    f.check();
+    shard.nimages = f.nimages();
+    shard.tmid = f.tmid();
+
+    if (shard.nshards < 1) {
+        throw runtime_error(filename + " was not written with --shard");
+    }
+}
+
+static bool same_times(const vector<double> &a, const vector<double> &b) {
+    return equal(a.begin(), a.end(), b.begin(), [](double x, double y) {
+        return (x == y) || ((x != x) && (y != y));
+    });
+}
+
+/* The shards must be exactly 0..N-1 of one N-way split of the same epochs,
+ * which their IMAGELIST TMIDs must match row for row */
+static void check_shards(const vector<Shard> &shards) {
+    for (size_t i = 0; i < shards.size(); i++) {
+        const Shard &shard = shards[i];
+        if ((shard.index != (int)i) ||
+            (shard.nshards != (int)shards.size())) {
+            stringstream ss;
+            ss << shard.file->filename << " is shard " << shard.index << "/"
+               << shard.nshards << ", expected " << i << "/"
+               << shards.size();
+            throw runtime_error(ss.str());
+        }
+        if ((shard.nimages != shards[0].nimages) ||
+            !same_times(shard.tmid, shards[0].tmid)) {
+            throw runtime_error(shard.file->filename +
+                                " covers different epochs to " +
+                                shards[0].file->filename);
+        }
+    }
+}
+
+/* Tables with one row per aperture: the CATALOGUE and STATS */
+static void merge_table(vector<Shard> &shards, const string &name,
+                        FITSFile *out, long napertures, long max_bytes) {
+    FITSFile &first = *shards[0].file;
+    map<string, ColumnDefinition> columns;
+    vector<string> order;
+    for (auto &column : first.column_description()) {
+        columns.insert(column);
+        order.push_back(column.first);
+    }
+    out->addBinaryTable(name, columns, napertures, order);
+
+    long offset = 0;
+    for (auto &shard : shards) {
+        FITSFile &f = *shard.file;
+        f.toHDU(name);
+        f.check();
+        if (f.rowBytes() != out->rowBytes()) {
+            throw runtime_error(name + " layout of " + f.filename +
+                                " differs from " + first.filename);
+        }
+        vector<Segment> rows(1);
+        rows[0].source_start = 0;
+        rows[0].output_start = offset;
+        rows[0].count = shard.napertures;
+        copyTableRows(f, out, rows, max_bytes);
+        offset += shard.napertures;
+    }
+}
+
+static void merge_image(vector<Shard> &shards, const string &name,
+                        FITSFile *out, long napertures, long max_bytes) {
+    FITSFile &first = *shards[0].file;
+    int image_type = 0;
+    fits_get_img_equivtype(first.fptr, &image_type, &first.status);
+    first.check();
+    long nimages = first.imageDimensions().nimages;
+    bool floating = (image_type == FLOAT_IMG) || (image_type == DOUBLE_IMG);
+
+    log << "Merging image " << name << endl;
+    out->addImage(name, nimages, napertures, image_type);
+
+    long offset = 0;
+    for (auto &shard : shards) {
+        FITSFile &f = *shard.file;
+        f.toHDU(name);
+        f.check();
+        ImageDimensions dim = f.imageDimensions();
+        if ((dim.nimages != nimages) || (dim.napertures != shard.napertures)) {
+            throw runtime_error("Image " + name + " of " + f.filename +
+                                " does not match its catalogue");
+        }
+
+        if (floating) {
+            copyImageRows<double>(f, out, dim, offset, max_bytes);
+        } else {
+            copyImageRows<long long>(f, out, dim, offset, max_bytes);
+        }
+        offset += dim.napertures;
+    }
+}
+
+void merge_shards(const vector<string> &filenames, const string &output,
+                  const StitchOptions &options) {
+    PhaseTimer timer("merge");
+    vector<Shard> shards(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+        describe_shard(filenames[i], shards[i]);
+    }
+    sort(shards.begin(), shards.end(), [](const Shard &a, const Shard &b) {
+        return a.index < b.index;
+    });
+    check_shards(shards);
+
+    long napertures = 0;
+    for (auto &shard : shards) {
+        napertures += shard.napertures;
+    }
+    log << "Merging " << shards.size() << " shards, " << napertures
+         << " apertures in total" << endl;
+
+    /* HDUs are written in the order of the first shard */
+    FITSFile &first = *shards[0].file;
+    unique_ptr<FITSFile> out(FITSFile::createFile(output));
+    int nhdu = -1;
+    fits_get_num_hdus(first.fptr, &nhdu, &first.status);
+    first.check();
+
+    for (int i = 1; i < nhdu; i++) {
+        first.toHDU(i);
+        first.check();
+        int hdutype = -1;
+        fits_get_hdu_type(first.fptr, &hdutype, &first.status);
+        first.check();
+        char extname[FLEN_VALUE];
+        fits_read_key(first.fptr, TSTRING, "EXTNAME", extname, NULL,
+                      &first.status);
+        first.check();
+
+        if (hdutype == IMAGE_HDU) {
+            merge_image(shards, extname, out.get(), napertures,
+                        options.max_buffer_bytes);
+        } else if ((string(extname) == "CATALOGUE") ||
+                   (string(extname) == "STATS")) {
+            merge_table(shards, extname, out.get(), napertures,
+                        options.max_buffer_bytes);
+        } else {
+            fits_copy_hdu(first.fptr, out->fptr, 0, &out->status);
+            out->check();
+        }
+    }
+}
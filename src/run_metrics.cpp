@@ -0,0 +1,136 @@
+#include "run_metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include "fits_file.h"
+
+using namespace std;
+
+RunMetrics metrics;
+
+RunMetrics::RunMetrics()
+    : bytes_read(0), bytes_written(0), pixels_copied(0), rows_copied(0),
+      fits_calls(0), bytes_expected(0), start(chrono::steady_clock::now()) {}
+
+void RunMetrics::addPhase(const string &name, double seconds) {
+    lock_guard<std::mutex> lock(mutex);
+    PhaseStats &stats = phases[name];
+    stats.seconds += seconds;
+    stats.calls++;
+}
+
+double RunMetrics::phaseSeconds(const string &name) {
+    lock_guard<std::mutex> lock(mutex);
+    auto stats = phases.find(name);
+    return stats == phases.end() ? 0 : stats->second.seconds;
+}
+
+static string json_string(const string &value) {
+    ostringstream out;
+    out << '"';
+    for (unsigned char c : value) {
+        if ((c == '"') || (c == '\\')) {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+string RunMetrics::json(int status, const string &error) {
+    chrono::duration<double> wall = chrono::steady_clock::now() - start;
+
+    ostringstream out;
+    out << setprecision(6) << fixed;
+    out << "{\n"
+        << "  \"status\": " << status << ",\n";
+    if (!error.empty()) {
+        out << "  \"error\": " << json_string(error) << ",\n";
+    }
+    out
+        << "  \"wall_seconds\": " << wall.count() << ",\n"
+        << "  \"peak_rss_kb\": " << peak_rss_kb() << ",\n"
+        << "  \"files_opened\": " << FITSFile::nopened << ",\n"
+        << "  \"fits_calls\": " << fits_calls << ",\n"
+        << "  \"bytes_read\": " << bytes_read << ",\n"
+        << "  \"bytes_written\": " << bytes_written << ",\n"
+        << "  \"pixels_copied\": " << pixels_copied << ",\n"
+        << "  \"rows_copied\": " << rows_copied << ",\n"
+        << "  \"phases\": {";
+
+    lock_guard<std::mutex> lock(mutex);
+    for (auto it = phases.begin(); it != phases.end(); ++it) {
+        out << (it == phases.begin() ? "\n" : ",\n") << "    \"" << it->first
+            << "\": {\"seconds\": " << it->second.seconds
+            << ", \"calls\": " << it->second.calls << "}";
+    }
+    out << "\n  }\n}\n";
+    return out.str();
+}
+
+void RunMetrics::writeJSON(const string &filename, int status,
+                           const string &error) {
+    ofstream out(filename.c_str());
+    out << json(status, error);
+    if (!out) {
+        throw runtime_error("Cannot write metrics to " + filename);
+    }
+}
+
+long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    /* Linux reports kilobytes */
+    return usage.ru_maxrss;
+}
+
+ProgressReporter::ProgressReporter(bool enabled)
+    : enabled(enabled), done(false), start(chrono::steady_clock::now()) {
+    if (!enabled) {
+        return;
+    }
+
+    long long initial = metrics.bytes_written;
+    thread = std::thread([this, initial] {
+        unique_lock<std::mutex> lock(mutex);
+        while (!cond.wait_for(lock, chrono::seconds(1),
+                              [this] { return done.load(); })) {
+            chrono::duration<double> elapsed =
+                chrono::steady_clock::now() - start;
+            double written = metrics.bytes_written - initial;
+            double expected = metrics.bytes_expected;
+            double rate = written / max(elapsed.count(), 1e-9);
+            double eta = rate > 0 ? (expected - written) / rate : 0;
+            fprintf(stderr, "\r%5.1f%% %9.1f MB  %7.1f MB/s  ETA %6.0fs",
+                    expected > 0 ? 100. * written / expected : 0.,
+                    written / 1048576., rate / 1048576., max(eta, 0.));
+            fflush(stderr);
+        }
+    });
+}
+
+ProgressReporter::~ProgressReporter() {
+    if (!enabled) {
+        return;
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cond.notify_one();
+    thread.join();
+    fprintf(stderr, "\n");
+}
@@ -0,0 +1,658 @@
+#include "stitch_plan.h"
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <algorithm>
+#include <queue>
+#include <numeric>
+#include <tuple>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "fits_file.h"
+#include "manifest_cache.h"
+#include "time_utils.h"
+
+using namespace std;
+
+/* Macro for set inclusion */
+#define in_set(V, S) ((S).find((V)) != (S).end())
+
+static string toUpper(const string &s) {
+    string tmp = s;
+    for_each(tmp.begin(), tmp.end(),
+             [](char &c) { c = toupper((unsigned char)c); });
+    return tmp;
+}
+
+static ImageHDU describe_image(FITSFile &source, int index) {
+    ImageHDU out;
+    out.index = index;
+
+    int compressed = 0;
+    fits_is_compressed_image(source.fptr, &compressed);
+    out.compressed = compressed;
+
+    fits_get_img_type(source.fptr, &out.bitpix, &source.status);
+    source.check();
+    out.bscale = source.readKey("BSCALE", 1.0);
+    out.bzero = source.readKey("BZERO", 0.0);
+    out.dimensions = source.imageDimensions();
+
+    LONGLONG headstart, datastart, dataend;
+    fits_get_hduaddrll(source.fptr, &headstart, &datastart, &dataend,
+                       &source.status);
+    source.check();
+    out.datastart = datastart;
+    return out;
+}
+
+static map<string, ColumnDefinition> column_map(FITSFile &source) {
+    map<string, ColumnDefinition> out;
+    for (auto column : source.column_description()) {
+        out.insert(column);
+    }
+    return out;
+}
+
+SourceFile describe_source(const string &filename) {
+    SourceFile out;
+    out.filename = filename;
+    out.catalogue_hdu = out.imagelist_hdu = out.index_hdu = -1;
+
+    FITSFile source(filename);
+    int nhdu = -1;
+    fits_get_num_hdus(source.fptr, &nhdu, &source.status);
+    source.check();
+
+    for (int i = 1; i < nhdu; i++) {
+        char buf[FLEN_VALUE];
+        source.toHDU(i);
+        source.check();
+        int hdutype = -1;
+        fits_get_hdu_type(source.fptr, &hdutype, &source.status);
+        source.check();
+        fits_read_key(source.fptr, TSTRING, "EXTNAME", buf, NULL,
+                      &source.status);
+        source.check();
+        string extname = toUpper(buf);
+
+        if (hdutype == IMAGE_HDU) {
+            out.image_hdus[buf] = describe_image(source, i);
+        } else if (extname == "CATALOGUE") {
+            out.catalogue_hdu = i;
+            out.catalogue_columns = column_map(source);
+        } else if (extname == "INDEX") {
+            out.index_hdu = i;
+        } else if (extname == "IMAGELIST") {
+            out.imagelist_hdu = i;
+            for (auto &column : source.column_description()) {
+                out.imagelist_columns.insert(column);
+                out.imagelist_order.push_back(column.first);
+            }
+        }
+    }
+
+    if ((out.catalogue_hdu < 0) || (out.imagelist_hdu < 0) ||
+        !in_set("FLUX", out.image_hdus)) {
+        throw runtime_error("Missing CATALOGUE, IMAGELIST or FLUX HDU in " +
+                            filename);
+    }
+
+    out.dimensions = out.image_hdus["FLUX"].dimensions;
+    out.nimages = source.nimages();
+
+    vector<double> tmid = source.tmid();
+    auto minmax_values = minmax_element(tmid.begin(), tmid.end());
+    out.mjd.min = *minmax_values.first;
+    out.mjd.max = *minmax_values.second;
+    out.sorted = is_sorted(tmid.begin(), tmid.end());
+    return out;
+}
+
+/* Apertures are taken from the first file; check_same_apertures or
+ * match_apertures reconcile the rest */
+static ImageDimensions get_image_dimensions(const vector<SourceFile> &sources) {
+    ImageDimensions out = {0, sources[0].dimensions.napertures};
+    for (auto &source : sources) {
+        out.nimages += source.dimensions.nimages;
+    }
+    return out;
+}
+
+static void
+merge_columns(map<string, ColumnDefinition> &out,
+              const map<string, ColumnDefinition> &column_description) {
+    for (auto column : column_description) {
+        if (out.find(column.first) == out.end()) {
+            out.insert(column);
+        } else {
+            int new_type = column.second.type;
+            int old_type = out[column.first].type;
+            if (new_type > old_type) {
+                out[column.first] = column.second;
+            }
+        }
+    }
+}
+
+static set<string> get_image_names(const vector<SourceFile> &sources) {
+    set<string> out;
+    set<string> to_skip;
+
+    /* Build skip list */
+    for (int i = 1; i < 14; i++) {
+        if (i != 2) {
+            stringstream ss;
+            ss << "FLUX_" << i;
+            to_skip.insert(ss.str());
+            ss.str("");
+            ss << "ERROR_" << i;
+            to_skip.insert(ss.str());
+        }
+    }
+
+    for (auto &source : sources) {
+        for (auto image : source.image_hdus) {
+            if (!in_set(image.first, to_skip)) {
+                out.insert(image.first);
+            }
+        }
+    }
+
+    return out;
+}
+
+int equivalent_image_type(const ImageHDU &hdu) {
+    if ((hdu.bscale == 1.0) && (hdu.bzero == 0.0)) {
+        return hdu.bitpix;
+    }
+
+    if (hdu.bscale == 1.0) {
+        if ((hdu.bitpix == BYTE_IMG) && (hdu.bzero == -128.0)) {
+            return SBYTE_IMG;
+        } else if ((hdu.bitpix == SHORT_IMG) && (hdu.bzero == 32768.0)) {
+            return USHORT_IMG;
+        } else if ((hdu.bitpix == LONG_IMG) && (hdu.bzero == 2147483648.0)) {
+            return ULONG_IMG;
+        }
+    }
+
+    /* Scaled data is read as floating point, as cfitsio does */
+    if ((imagePixelSize(hdu.bitpix) <= 2) || (hdu.bitpix == FLOAT_IMG)) {
+        return FLOAT_IMG;
+    }
+    return DOUBLE_IMG;
+}
+
+int storage_bitpix(int image_type) {
+    switch (image_type) {
+    case SBYTE_IMG:
+        return BYTE_IMG;
+    case USHORT_IMG:
+        return SHORT_IMG;
+    case ULONG_IMG:
+        return LONG_IMG;
+    default:
+        return image_type;
+    }
+}
+
+static int integer_image_type(int bits, bool is_signed) {
+    switch (bits) {
+    case 8:
+        return is_signed ? SBYTE_IMG : BYTE_IMG;
+    case 16:
+        return is_signed ? SHORT_IMG : USHORT_IMG;
+    case 32:
+        return is_signed ? LONG_IMG : ULONG_IMG;
+    default:
+        return is_signed ? LONGLONG_IMG : DOUBLE_IMG;
+    }
+}
+
+/* Narrowest image type that can hold every value of both `a` and `b` */
+static int widen_image_type(int a, int b) {
+    if (a == b) {
+        return a;
+    }
+    if ((a == DOUBLE_IMG) || (b == DOUBLE_IMG)) {
+        return DOUBLE_IMG;
+    }
+    if ((a == FLOAT_IMG) || (b == FLOAT_IMG)) {
+        /* floats hold integers of up to 24 bits exactly */
+        int other = (a == FLOAT_IMG) ? b : a;
+        return imagePixelSize(other) <= 2 ? FLOAT_IMG : DOUBLE_IMG;
+    }
+
+    bool a_signed = (a != BYTE_IMG) && (a != USHORT_IMG) && (a != ULONG_IMG);
+    bool b_signed = (b != BYTE_IMG) && (b != USHORT_IMG) && (b != ULONG_IMG);
+    int a_bits = 8 * imagePixelSize(a), b_bits = 8 * imagePixelSize(b);
+    if (a_signed == b_signed) {
+        return integer_image_type(max(a_bits, b_bits), a_signed);
+    }
+
+    /* A signed type needs twice the bits to hold an unsigned one */
+    int unsigned_bits = a_signed ? b_bits : a_bits;
+    int signed_bits = a_signed ? a_bits : b_bits;
+    int bits = max(signed_bits, 2 * unsigned_bits);
+    return bits > 64 ? DOUBLE_IMG : integer_image_type(bits, true);
+}
+
+static map<string, int> get_image_types(const vector<SourceFile> &sources,
+                                        const set<string> &image_names) {
+    map<string, int> out;
+    for (auto &source : sources) {
+        for (auto &image : source.image_hdus) {
+            if (!in_set(image.first, image_names)) {
+                continue;
+            }
+
+            int type = equivalent_image_type(image.second);
+            auto current = out.find(image.first);
+            if (current == out.end()) {
+                out[image.first] = type;
+            } else {
+                current->second = widen_image_type(current->second, type);
+            }
+        }
+    }
+    return out;
+}
+
+/* Add output row `output_row` <- source row `source_row`, extending the last
+ * segment where possible */
+static void add_row(vector<Segment> &segments, long source_row,
+                    long output_row) {
+    if (!segments.empty()) {
+        Segment &last = segments.back();
+        if ((last.source_start + last.count == source_row) &&
+            (last.output_start + last.count == output_row)) {
+            last.count++;
+            return;
+        }
+    }
+    Segment segment = {source_row, output_row, 1};
+    segments.push_back(segment);
+}
+
+MJDRange all_mjds() {
+    MJDRange out = {-numeric_limits<double>::infinity(),
+                    numeric_limits<double>::infinity()};
+    return out;
+}
+
+static bool within(const MJDRange &range, const MJDRange &window) {
+    return (range.min >= window.min) && (range.max <= window.max);
+}
+
+/* Remove from `order` the IMAGELIST rows of `f` failing the cfitsio row
+ * filter `filter` */
+static void apply_frame_filter(FITSFile &f, const string &filter,
+                               vector<long> &order) {
+    long nrows = f.nimages();
+    vector<char> row_status(nrows);
+    long ngood = 0;
+    if (nrows > 0) {
+        fits_find_rows(f.fptr, (char *)filter.c_str(), 1, nrows, &ngood,
+                       &row_status[0], &f.status);
+        f.check("frame filter \"" + filter + "\"");
+    }
+    order.erase(remove_if(order.begin(), order.end(),
+                          [&](long row) { return !row_status[row]; }),
+                order.end());
+}
+
+/* k-way merge of a group of files whose TMID ranges overlap, keeping only
+ * rows inside `window` that pass `filter`. Only the TMID columns are held
+ * in memory; the result is a list of segments per file. */
+static long merge_by_tmid(const vector<SourceFile *> &group, long output_row,
+                          const MJDRange &window, const string &filter) {
+    vector<vector<double>> tmids;
+    vector<vector<long>> orders;
+    for (auto source : group) {
+        FITSFile f(source->filename);
+        tmids.push_back(f.tmid());
+        const vector<double> &tmid = tmids.back();
+
+        vector<long> order(tmid.size());
+        iota(order.begin(), order.end(), 0L);
+        if (!filter.empty()) {
+            apply_frame_filter(f, filter, order);
+        }
+        if (!within(source->mjd, window)) {
+            order.erase(remove_if(order.begin(), order.end(),
+                                  [&](long row) {
+                                      return (tmid[row] < window.min) ||
+                                             (tmid[row] > window.max);
+                                  }),
+                        order.end());
+        }
+        if (!source->sorted) {
+            stable_sort(order.begin(), order.end(), [&](long a, long b) {
+                return tmid[a] < tmid[b];
+            });
+        }
+        orders.push_back(order);
+    }
+
+    /* (tmid, file, position in that file's order), ties broken by file so
+     * that the output is deterministic */
+    typedef tuple<double, size_t, size_t> Cursor;
+    priority_queue<Cursor, vector<Cursor>, greater<Cursor>> heap;
+    for (size_t i = 0; i < group.size(); i++) {
+        if (!orders[i].empty()) {
+            heap.push(Cursor(tmids[i][orders[i][0]], i, 0));
+        }
+    }
+
+    while (!heap.empty()) {
+        Cursor cursor = heap.top();
+        heap.pop();
+        size_t file = get<1>(cursor), pos = get<2>(cursor);
+        add_row(group[file]->segments, orders[file][pos], output_row++);
+
+        if (++pos < orders[file].size()) {
+            heap.push(Cursor(tmids[file][orders[file][pos]], file, pos));
+        }
+    }
+
+    return output_row;
+}
+
+/* Assign output rows so that the stitched IMAGELIST is in TMID order, and
+ * return the number of rows. Files that neither overlap another file, need
+ * sorting internally nor straddle the window are one segment each; only the
+ * rest have their TMIDs read and merged. With a frame filter every file is
+ * read, to find its rejected rows. */
+static long order_by_tmid(vector<SourceFile> &sources, const MJDRange &window,
+                          const string &filter) {
+    long output_row = 0;
+    size_t i = 0;
+    while (i < sources.size()) {
+        vector<SourceFile *> group(1, &sources[i]);
+        double group_end = sources[i].mjd.max;
+        for (i++; (i < sources.size()) && (sources[i].mjd.min < group_end);
+             i++) {
+            group.push_back(&sources[i]);
+            group_end = max(group_end, sources[i].mjd.max);
+        }
+
+        for (auto source : group) {
+            source->segments.clear();
+        }
+
+        if ((group.size() == 1) && group[0]->sorted &&
+            within(group[0]->mjd, window) && filter.empty()) {
+            Segment segment = {0, output_row, group[0]->nimages};
+            group[0]->segments.push_back(segment);
+            output_row += group[0]->nimages;
+        } else {
+            if ((group.size() > 1) || !group[0]->sorted) {
+                log << "Merging " << group.size()
+                     << " overlapping or unsorted files by TMID" << endl;
+            }
+            output_row = merge_by_tmid(group, output_row, window, filter);
+        }
+    }
+    return output_row;
+}
+
+/* Drop sources with no TMIDs inside `window` */
+static void skip_outside(vector<SourceFile> &sources, const MJDRange &window) {
+    size_t before = sources.size();
+    sources.erase(remove_if(sources.begin(), sources.end(),
+                            [&](const SourceFile &source) {
+                                return (source.mjd.max < window.min) ||
+                                       (source.mjd.min > window.max);
+                            }),
+                  sources.end());
+    if (sources.size() < before) {
+        log << "Skipping " << (before - sources.size())
+             << " files outside the MJD window" << endl;
+    }
+    if (sources.empty()) {
+        throw runtime_error("No input files overlap the MJD window");
+    }
+}
+
+/* Drop sources left with no rows to copy, which happens to files that
+ * straddle the window without a frame inside it as well as to those whose
+ * frames all fail the filter */
+static void skip_empty(vector<SourceFile> &sources) {
+    size_t before = sources.size();
+    sources.erase(remove_if(sources.begin(), sources.end(),
+                            [](const SourceFile &source) {
+                                return source.segments.empty();
+                            }),
+                  sources.end());
+    if (sources.size() < before) {
+        log << "Skipping " << (before - sources.size())
+             << " files with no frames to copy" << endl;
+    }
+    if (sources.empty()) {
+        throw runtime_error("No frames lie in the MJD window and pass the "
+                            "filter");
+    }
+}
+
+StitchPlan build_plan(const vector<string> &files, ManifestCache *cache,
+                      const MJDRange &window, const string &filter) {
+    StitchPlan plan;
+    long nrows = 0;
+
+    log << "Reading headers from " << files.size() << " files" << endl;
+    long hits = 0;
+    {
+        PhaseTimer timer("plan.describe", false);
+        for (auto &filename : files) {
+            bool hit = false;
+            plan.sources.push_back(cache ? cache->describe(filename, &hit)
+                                         : describe_source(filename));
+            hits += hit;
+        }
+    }
+
+    if (cache) {
+        log << "Manifest cache: " << hits << " unchanged, "
+             << files.size() - hits << " scanned" << endl;
+    }
+
+    {
+        PhaseTimer timer("plan.order", false);
+        skip_outside(plan.sources, window);
+        log << "Sorting files by mjd" << endl;
+        stable_sort(plan.sources.begin(), plan.sources.end(),
+                    [](const SourceFile &a, const SourceFile &b) -> bool {
+                        return a.mjd.min < b.mjd.min;
+                    });
+
+        nrows = order_by_tmid(plan.sources, window, filter);
+        if (!filter.empty()) {
+            long total = 0;
+            for (auto &source : plan.sources) {
+                total += source.nimages;
+            }
+            log << "Frame filter kept " << nrows << " of " << total
+                 << " frames" << endl;
+        }
+        if (!filter.empty() || (window.min > all_mjds().min) ||
+            (window.max < all_mjds().max)) {
+            skip_empty(plan.sources);
+        }
+    }
+    if (nrows == 0) {
+        throw runtime_error("No frames to stitch");
+    }
+
+    PhaseTimer timer("plan.layout", false);
+    plan.dimensions = get_image_dimensions(plan.sources);
+    plan.dimensions.nimages = nrows;
+    for (auto &source : plan.sources) {
+        merge_columns(plan.imagelist_columns, source.imagelist_columns);
+        merge_columns(plan.catalogue_columns, source.catalogue_columns);
+        for (auto &name : source.imagelist_order) {
+            if (find(plan.imagelist_order.begin(), plan.imagelist_order.end(),
+                     name) == plan.imagelist_order.end()) {
+                plan.imagelist_order.push_back(name);
+            }
+        }
+    }
+    plan.image_names = get_image_names(plan.sources);
+    plan.image_types = get_image_types(plan.sources, plan.image_names);
+
+    for (auto &source : plan.sources) {
+        Segment all_apertures = {0, 0, source.dimensions.napertures};
+        source.aperture_runs.assign(1, all_apertures);
+        source.catalogue_runs.clear();
+    }
+    plan.sources[0].catalogue_runs = plan.sources[0].aperture_runs;
+    return plan;
+}
+
+void check_same_apertures(const StitchPlan &plan) {
+    for (auto &source : plan.sources) {
+        if (source.dimensions.napertures != plan.dimensions.napertures) {
+            stringstream ss;
+            ss << "Image dimensions do not match: " << source.filename
+               << " has " << source.dimensions.napertures
+               << " apertures, expected " << plan.dimensions.napertures;
+            throw runtime_error(ss.str());
+        }
+    }
+}
+
+void restrict_apertures(StitchPlan &plan, const vector<long> &apertures) {
+    vector<Segment> runs;
+    for (size_t i = 0; i < apertures.size(); i++) {
+        add_row(runs, apertures[i], i);
+    }
+    for (auto &source : plan.sources) {
+        source.aperture_runs = runs;
+        source.catalogue_runs.clear();
+    }
+    plan.sources[0].catalogue_runs = runs;
+    plan.dimensions.napertures = apertures.size();
+    log << "Copying " << apertures.size() << " apertures in " << runs.size()
+         << " runs" << endl;
+}
+
+/* Key of every CATALOGUE row of `source` */
+static vector<string> catalogue_keys(const SourceFile &source,
+                                     const string &key) {
+    FITSFile f(source.filename);
+    f.toHDU(source.catalogue_hdu);
+    f.check();
+    int colnum = f.colnum(key);
+    if (colnum == -1) {
+        throw runtime_error("No " + key + " column in the CATALOGUE of " +
+                            source.filename);
+    }
+    return readStringColumn(f, source.dimensions.napertures, colnum);
+}
+
+void match_apertures(StitchPlan &plan, const string &key, bool intersection) {
+    vector<vector<string>> keys;
+    for (auto &source : plan.sources) {
+        keys.push_back(catalogue_keys(source, key));
+    }
+
+    /* Output aperture of each key, and how many files have it */
+    unordered_map<string, long> output;
+    vector<string> order;
+    vector<long> nfiles;
+    for (size_t s = 0; s < keys.size(); s++) {
+        unordered_set<string> seen;
+        for (auto &value : keys[s]) {
+            if (!seen.insert(value).second) {
+                continue;
+            }
+            auto found = output.find(value);
+            if (found == output.end()) {
+                output[value] = order.size();
+                order.push_back(value);
+                nfiles.push_back(1);
+            } else {
+                nfiles[found->second]++;
+            }
+        }
+    }
+
+    if (intersection) {
+        long kept = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            if (nfiles[i] == (long)keys.size()) {
+                output[order[i]] = kept++;
+            } else {
+                output.erase(order[i]);
+            }
+        }
+    }
+    plan.dimensions.napertures = output.size();
+
+    /* Source rows are visited in order, so runs of consecutive apertures in
+     * both files stay single segments and are copied in one go */
+    vector<bool> supplied(output.size(), false);
+    for (size_t s = 0; s < keys.size(); s++) {
+        SourceFile &source = plan.sources[s];
+        source.aperture_runs.clear();
+        source.catalogue_runs.clear();
+        long duplicates = 0;
+        unordered_set<string> seen;
+        for (long row = 0; row < (long)keys[s].size(); row++) {
+            auto found = output.find(keys[s][row]);
+            if (found == output.end()) {
+                continue;
+            }
+            if (!seen.insert(keys[s][row]).second) {
+                duplicates++;
+                continue;
+            }
+            add_row(source.aperture_runs, row, found->second);
+            if (!supplied[found->second]) {
+                supplied[found->second] = true;
+                add_row(source.catalogue_runs, row, found->second);
+            }
+        }
+
+        long matched = 0;
+        for (auto &run : source.aperture_runs) {
+            matched += run.count;
+        }
+        log << source.filename << ": " << matched << " of "
+             << source.dimensions.napertures << " apertures matched by "
+             << key << " in " << source.aperture_runs.size() << " runs"
+             << endl;
+        if (duplicates) {
+            log << "Warning: " << duplicates << " repeated " << key
+                 << " values in " << source.filename
+                 << ", only the first is copied" << endl;
+        }
+    }
+    log << "Matched " << plan.dimensions.napertures << " apertures by " << key
+         << (intersection ? " (intersection)" : " (union)") << endl;
+}
+
+vector<Segment> missing_apertures(const SourceFile &source, long napertures) {
+    vector<Segment> covered = source.aperture_runs;
+    sort(covered.begin(), covered.end(),
+         [](const Segment &a, const Segment &b) {
+             return a.output_start < b.output_start;
+         });
+
+    vector<Segment> missing;
+    long next = 0;
+    for (auto &run : covered) {
+        if (run.output_start > next) {
+            Segment gap = {next, next, run.output_start - next};
+            missing.push_back(gap);
+        }
+        next = max(next, run.output_start + run.count);
+    }
+    if (next < napertures) {
+        Segment gap = {next, next, napertures - next};
+        missing.push_back(gap);
+    }
+    return missing;
+}
@@ -1,11 +1,42 @@
 #include "time_utils.h"
 #include <string>
+#include <ctime>
+#include <cstdio>
+#include <iostream>
 
+#include "run_metrics.h"
+
+/* Formatting the date is only needed once a second, so each thread keeps
+ * the last one and appends the milliseconds */
 const std::string current_time() {
-    time_t now = time(0);
-    struct tm tstruct;
-    char buf[80];
-    tstruct = *localtime(&now);
-    strftime(buf, sizeof(buf), "%H:%M:%S", &tstruct);
+    static thread_local time_t last = 0;
+    static thread_local char seconds[16];
+
+    auto now = std::chrono::system_clock::now();
+    time_t t = std::chrono::system_clock::to_time_t(now);
+    if (t != last) {
+        struct tm tstruct;
+        localtime_r(&t, &tstruct);
+        strftime(seconds, sizeof(seconds), "%H:%M:%S", &tstruct);
+        last = t;
+    }
+
+    long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  now.time_since_epoch()).count() % 1000;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s.%03ld", seconds, ms);
     return buf;
 }
+
+PhaseTimer::PhaseTimer(const std::string &name, bool report)
+    : name(name), report(report), start(std::chrono::steady_clock::now()) {}
+
+PhaseTimer::~PhaseTimer() {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    metrics.addPhase(name, elapsed.count());
+    if (report) {
+        log << "Phase " << name << " took " << elapsed.count() << "s"
+            << std::endl;
+    }
+}
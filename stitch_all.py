@@ -69,35 +69,67 @@ def get_available_field_cameras():
     return (f for f in get_all_field_cameras() if valid(f))
 
 
-def build_zlp_stitch_command(field, camera_id, files):
-    binary_path = os.path.realpath(os.path.join(os.path.dirname(__file__), 'zlp-stitch'))
+def output_file_name(field, camera_id, shard=None):
     output_path = os.path.join('/', 'ngts', 'pipedev', 'ParanalOutput', 'per_field')
-    output_stub = '{field}-{camera_id}.fits'.format(field=field, camera_id=camera_id)
-    output_path = os.path.join(output_path, output_stub)
+    output_stub = '{field}-{camera_id}'.format(field=field, camera_id=camera_id)
+    if shard is not None:
+        output_stub += '.shard{}'.format(shard)
+    return os.path.join(output_path, output_stub + '.fits')
+
+
+def build_zlp_stitch_command(output_path, files, extra_args=()):
+    binary_path = os.path.realpath(os.path.join(os.path.dirname(__file__), 'zlp-stitch'))
     cmd = [binary_path, '-o', output_path]
+    cmd.extend(extra_args)
     cmd.extend(files)
     logger.debug('cmd: %s', ' '.join(cmd))
     return map(str, cmd)
 
 
-def build_qsub_command(field, camera_id):
-    name = 'stitch-{field}-{camera_id}'.format(field=field, camera_id=camera_id)
+def build_qsub_command(name, hold_jobs=()):
     log_name = os.path.join(LOGDIR, '{}.log'.format(name))
-    return map(str, ['/usr/local/sge/bin/lx-amd64/qsub', '-N', name, '-j', 'yes', '-o',
-                     log_name, '-b', 'y', '-pe', 'parallel', 24])
-
+    cmd = ['/usr/local/sge/bin/lx-amd64/qsub', '-N', name, '-j', 'yes', '-o',
+           log_name, '-b', 'y', '-pe', 'parallel', 24]
+    if hold_jobs:
+        cmd.extend(['-hold_jid', ','.join(hold_jobs)])
+    return map(str, cmd)
 
-def spawn_job(field, camera_id, files):
-    zlp_stitch_command = build_zlp_stitch_command(field=field,
-                                                  camera_id=camera_id,
-                                                  files=files)
 
-    qsub_command_string = build_qsub_command(field, camera_id)
-    command_string = qsub_command_string + zlp_stitch_command
+def submit(name, zlp_stitch_command, hold_jobs=()):
+    command_string = build_qsub_command(name, hold_jobs) + zlp_stitch_command
     qsub_env = {'SGE_ROOT': '/usr/local/sge'}
     sp.check_call(command_string, env=qsub_env)
 
 
+def spawn_job(field, camera_id, files, shards=1):
+    name = 'stitch-{field}-{camera_id}'.format(field=field, camera_id=camera_id)
+    output_path = output_file_name(field, camera_id)
+    if shards <= 1:
+        submit(name, build_zlp_stitch_command(output_path, files))
+        return
+
+    # One job per aperture range, then a merge job once they have all finished
+    shard_names, shard_files = [], []
+    for shard in range(shards):
+        shard_name = '{}-shard{}'.format(name, shard)
+        shard_file = output_file_name(field, camera_id, shard)
+        submit(shard_name, build_zlp_stitch_command(
+            shard_file, files, ['--shard', '{}/{}'.format(shard, shards)]))
+        shard_names.append(shard_name)
+        shard_files.append(shard_file)
+
+    submit('{}-merge'.format(name),
+           build_zlp_stitch_command(output_path, shard_files, ['--merge-shards']),
+           hold_jobs=shard_names)
+
+
+def spawn_batch_job(mapping_file):
+    # Every field in one process; a failing field does not stop the others
+    output_path = os.path.dirname(output_file_name('', ''))
+    submit('stitch-batch', build_zlp_stitch_command(
+        output_path, [], ['--batch', os.path.realpath(mapping_file)]))
+
+
 class Mapping(object):
 
     join_char = '@'
@@ -172,10 +204,17 @@ def main(args):
         logger.debug('Rendering mapping to file %s', args.save_mapping)
         mapping.to_file(args.save_mapping)
 
-    if args.run:
+    if args.run and args.batch:
+        mapping_file = args.save_mapping or args.mapping
+        if mapping_file is None:
+            mapping_file = os.path.join(LOGDIR, 'stitch-mapping.json')
+            mapping.to_file(mapping_file)
+        spawn_batch_job(mapping_file)
+    elif args.run:
         for key in mapping:
             field, camera_id = key
-            spawn_job(field=field, camera_id=camera_id, files=sorted(mapping[key]))
+            spawn_job(field=field, camera_id=camera_id, files=sorted(mapping[key]),
+                      shards=args.shards)
 
 
 if __name__ == '__main__':
@@ -189,4 +228,8 @@ if __name__ == '__main__':
     parser.add_argument('-s', '--save-mapping',
                         required=False,
                         help='Save mapping information')
+    parser.add_argument('--shards', type=int, default=1,
+                        help='Split each field across this many jobs by aperture')
+    parser.add_argument('--batch', action='store_true',
+                        help='Stitch every field in a single job')
     main(parser.parse_args())
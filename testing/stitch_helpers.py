@@ -0,0 +1,68 @@
+'''
+Write small nightly files and run zlp-stitch over them
+'''
+
+import os
+import subprocess
+
+import numpy as np
+from astropy.io import fits
+import pytest
+
+BINARY = './zlp-stitch'
+
+needs_binary = pytest.mark.skipif(not os.path.isfile(BINARY),
+        reason="zlp-stitch has not been built")
+
+
+def has_backend(name):
+    '''
+    Whether zlp-stitch was built with I/O backend `name`
+    '''
+    if not os.path.isfile(BINARY):
+        return False
+    child = subprocess.Popen([BINARY, '--io-backend', name, '-o', os.devnull],
+                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    log = child.communicate()[0].decode('utf-8', 'replace')
+    return 'is not available' not in log
+
+
+def write_source(filename, tmid, images, obj_ids=None):
+    '''
+    Write a nightly file with one IMAGELIST row per entry of `tmid` and an
+    image HDU of shape (napertures, nimages) per entry of `images`. HJD is
+    added with every aperture at TMID.
+    '''
+    tmid = np.asarray(tmid, dtype=np.float64)
+    napertures = next(iter(images.values())).shape[0]
+    if obj_ids is None:
+        obj_ids = ['OBJ{:06d}'.format(i) for i in range(napertures)]
+
+    catalogue = fits.BinTableHDU.from_columns([
+        fits.Column(name='OBJ_ID', format='20A', array=obj_ids),
+        fits.Column(name='FLUX_MEAN', format='D',
+                    array=np.arange(napertures, dtype=np.float64)),
+    ], name='CATALOGUE')
+    imagelist = fits.BinTableHDU.from_columns([
+        fits.Column(name='TMID', format='D', array=tmid),
+        fits.Column(name='IMAGE_ID', format='K',
+                    array=np.arange(tmid.size)),
+    ], name='IMAGELIST')
+
+    hdus = [fits.PrimaryHDU(), catalogue, imagelist,
+            fits.ImageHDU(np.tile(tmid, (napertures, 1)), name='HJD')]
+    for name, data in images.items():
+        hdus.append(fits.ImageHDU(np.asarray(data), name=name))
+    fits.HDUList(hdus).writeto(filename, overwrite=True)
+
+
+def stitch(files, output, *extra):
+    '''
+    Run zlp-stitch, failing the test with its log if it exits non-zero
+    '''
+    command = [BINARY] + list(files) + ['-o', output] + list(extra)
+    child = subprocess.Popen(command, stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT)
+    log = child.communicate()[0].decode('utf-8', 'replace')
+    assert child.returncode == 0, log
+    return log
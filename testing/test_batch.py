@@ -0,0 +1,98 @@
+import json
+import os
+import shutil
+import subprocess
+
+from astropy.io import fits
+import pytest
+
+BINARY = './zlp-stitch'
+SOURCE = 'testing/data/smaller.fits'
+
+pytestmark = pytest.mark.skipif(not os.path.isfile(BINARY),
+        reason="zlp-stitch has not been built")
+
+
+@pytest.fixture
+def source(tmpdir):
+    fname = str(tmpdir.join('night.fits'))
+    shutil.copyfile(SOURCE, fname)
+    return fname
+
+
+def run_batch(tmpdir, text):
+    mapping = tmpdir.join('mapping.json')
+    mapping.write(text)
+    outdir = tmpdir.mkdir('out')
+    child = subprocess.Popen([BINARY, '--batch', str(mapping),
+                              '-o', str(outdir)],
+                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    output = child.communicate()[0].decode('utf-8', 'replace')
+    return child.returncode, output, outdir
+
+
+def test_escapes(tmpdir, source):
+    # @ is '@' and \/ is '/'
+    text = '{"F1\\u0040801": ["%s"]}' % source.replace('/', '\\/')
+    status, output, outdir = run_batch(tmpdir, text)
+
+    assert status == 0, output
+    with fits.open(str(outdir.join('F1-801.fits'))) as infile:
+        assert len(infile['imagelist'].data) == len(
+            fits.getdata(source, 'imagelist'))
+
+
+def test_fields_in_file_order(tmpdir, source):
+    text = json.dumps({'B@1': [source], 'A@2': [source]})
+    status, output, outdir = run_batch(tmpdir, text)
+
+    assert status == 0, output
+    assert output.index('Field B-1') < output.index('Field A-2')
+    assert outdir.join('A-2.fits').check()
+
+
+def test_nested_object_is_not_a_file_list(tmpdir, source):
+    text = json.dumps({'F1@801': [source],
+                       'F2@802': {'files': [source], 'meta': {'n': 1}}})
+    status, output, _ = run_batch(tmpdir, text)
+
+    assert status != 0
+    assert 'F2@802' in output and 'not a list of files' in output
+
+
+def test_non_string_file(tmpdir):
+    status, output, _ = run_batch(tmpdir, '{"F1@801": ["a.fits", 3]}')
+
+    assert status != 0
+    assert 'non-string file' in output
+
+
+def test_not_a_mapping(tmpdir):
+    status, output, _ = run_batch(tmpdir, '["a.fits"]')
+
+    assert status != 0
+    assert 'is not a field mapping' in output
+
+
+def test_missing_field_files(tmpdir):
+    status, output, _ = run_batch(tmpdir, '{"F1@801": ["missing.fits"]}')
+
+    assert status != 0
+    assert 'Failed: F1-801' in output
+
+
+@pytest.mark.parametrize('text, message', [
+    ('{"F1@801": ["a.fits"]', "unexpected end of input"),
+    ('{"F1@801" ["a.fits"]}', "expected ':'"),
+    ('{"F1@801": ["a.fits",]}', "unexpected character"),
+    ('{"F1@801": ["a\\qb.fits"]}', "Invalid JSON"),
+    ('', "unexpected end of input"),
+    ('{} {}', "trailing characters"),
+    ('{"F1@801": ["\\u00zz"]}', "invalid \\u escape"),
+])
+def test_malformed(tmpdir, text, message):
+    status, output, _ = run_batch(tmpdir, text)
+
+    assert status != 0
+    assert 'Invalid JSON at offset' in output
+    assert message in output
@@ -0,0 +1,107 @@
+import sys
+
+import numpy as np
+from astropy.io import fits
+import pytest
+
+sys.path.insert(0, 'testing')
+from stitch_helpers import needs_binary, write_source, stitch
+
+MINUTE = 1. / (24 * 60)
+OBJ_IDS = ['A', 'B', 'C']
+
+
+def night(minutes):
+    '''
+    TMIDs at `minutes` past MJD 100, which is on the edge of an hour bin
+    '''
+    return 100. + np.asarray(minutes, dtype=np.float64) * MINUTE
+
+
+@pytest.fixture
+def nights(tmpdir):
+    '''
+    Two nights whose frames share the 60-120 minute bin, the second lacking
+    aperture B. FLUX has NaNs and FLUXERR one NaN and one zero error.
+    '''
+    rng = np.random.RandomState(7)
+    layout = [(night(np.arange(9) * 10 + 5), OBJ_IDS),
+              (night(np.arange(6) * 10 + 95), ['A', 'C'])]
+    files, data = [], []
+    for i, (tmid, obj_ids) in enumerate(layout):
+        shape = (len(obj_ids), tmid.size)
+        flux = rng.normal(1000., 10., shape)
+        err = rng.uniform(1., 5., shape)
+        flux[0, 1] = np.nan
+        err[-1, 2] = np.nan
+        err[-1, 3] = 0.
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        write_source(files[-1], tmid, {'FLUX': flux, 'FLUXERR': err},
+                     obj_ids=obj_ids)
+        data.append((tmid, obj_ids, flux, err))
+    return files, data
+
+
+def weighted_bin(flux, err):
+    ok = np.isfinite(flux) & (err > 0)
+    w = 1. / err[ok] ** 2
+    sw = w.sum()
+    return (w * flux[ok]).sum() / sw, 1. / np.sqrt(sw), ok.sum()
+
+
+@needs_binary
+def test_binned_output(tmpdir, nights):
+    files, data = nights
+    output = str(tmpdir.join('out.fits'))
+    stitch(files, output, '--bin-minutes', '60', '--match-apertures', 'union')
+
+    # Frames of the two nights in the shared hour stay in separate bins
+    bins = [(0, slice(0, 6)), (0, slice(6, 9)), (1, slice(0, 3)),
+            (1, slice(3, 6))]
+    with fits.open(output) as infile:
+        imagelist = infile['IMAGELIST'].data
+        assert list(imagelist['NFRAMES']) == [6, 3, 3, 3]
+        np.testing.assert_allclose(
+            imagelist['TMID'], [data[n][0][s].mean() for n, s in bins],
+            rtol=0, atol=1e-9)
+        np.testing.assert_allclose(
+            infile['HJD'].data,
+            np.tile(imagelist['TMID'], (len(OBJ_IDS), 1)), rtol=0, atol=1e-9)
+
+        flux = infile['FLUX'].data
+        fluxerr = infile['FLUXERR'].data
+        npoints = infile['NPOINTS'].data
+
+    for b, (n, frames) in enumerate(bins):
+        tmid, obj_ids, night_flux, night_err = data[n]
+        for a, obj_id in enumerate(OBJ_IDS):
+            if obj_id not in obj_ids:
+                assert np.isnan(flux[a, b]) and np.isnan(fluxerr[a, b])
+                assert npoints[a, b] == 0
+                continue
+            row = obj_ids.index(obj_id)
+            mean, error, count = weighted_bin(night_flux[row, frames],
+                                              night_err[row, frames])
+            assert flux[a, b] == pytest.approx(mean, rel=1e-12)
+            assert fluxerr[a, b] == pytest.approx(error, rel=1e-12)
+            assert npoints[a, b] == count
+
+
+@needs_binary
+def test_binned_flux_without_errors(tmpdir):
+    '''
+    A night without FLUXERR has plain mean FLUX, no error and a count of
+    the finite fluxes
+    '''
+    flux = np.array([[1., 2., np.nan, 4.]])
+    files = [str(tmpdir.join('errors.fits')), str(tmpdir.join('plain.fits'))]
+    write_source(files[0], night([5, 15]),
+                 {'FLUX': np.ones((1, 2)), 'FLUXERR': np.ones((1, 2))})
+    write_source(files[1], night([65, 75, 85, 95]), {'FLUX': flux})
+    output = str(tmpdir.join('out.fits'))
+    stitch(files, output, '--bin-minutes', '60')
+
+    with fits.open(output) as infile:
+        assert infile['FLUX'].data[0, 1] == pytest.approx(7. / 3)
+        assert np.isnan(infile['FLUXERR'].data[0, 1])
+        assert infile['NPOINTS'].data[0, 1] == 3
@@ -2,6 +2,10 @@ import numpy as np
 from astropy.io import fits
 import pytest
 import os
+import sys
+sys.path.insert(0, 'testing')
+
+from stitch_helpers import needs_binary, write_source, stitch
 
 TEST_FILENAME = 'out.fits'
 
@@ -14,3 +18,63 @@ def test_sorted_mjd_order():
 
     assert (tmid == np.sort(tmid)).all()
 
+
+
+@needs_binary
+def test_flux_stats(tmpdir):
+    np.random.seed(42)
+    nimages = 2000
+    flux = np.random.normal(1E3, 10., (4, nimages))
+    flux[1] = np.nan
+    flux[2, ::3] = np.nan
+    # A leading infinity must not become the shift the sums are taken about
+    flux[2, 1] = np.inf
+    flux[2, 5] = -np.inf
+    flux[3] = np.random.exponential(50., nimages)
+    source = str(tmpdir.join('night.fits'))
+    output = str(tmpdir.join('out.fits'))
+    write_source(source, np.linspace(57000., 57000.4, nimages),
+                 {'FLUX': flux})
+    stitch([source], output, '--stats', 'FLUX')
+
+    stats = fits.getdata(output, 'stats')
+    finite = np.isfinite(flux).any(axis=1)
+    assert (stats['flux_count'] == np.isfinite(flux).sum(axis=1)).all()
+    flux = np.where(np.isfinite(flux), flux, np.nan)
+    with np.errstate(invalid='ignore'):
+        assert np.allclose(stats['flux_mean'][finite],
+                           np.nanmean(flux[finite], axis=1))
+        assert np.allclose(stats['flux_rms'][finite],
+                           np.nanstd(flux[finite], axis=1))
+    assert np.allclose(stats['flux_min'][finite],
+                       np.nanmin(flux[finite], axis=1))
+    assert np.allclose(stats['flux_max'][finite],
+                       np.nanmax(flux[finite], axis=1))
+
+    # P-squared estimates, within a small fraction of each aperture's spread
+    for column, level in [('flux_q10', 10), ('flux_median', 50),
+                          ('flux_q90', 90)]:
+        expected = np.nanpercentile(flux[finite], level, axis=1)
+        spread = np.nanstd(flux[finite], axis=1)
+        assert (np.abs(stats[column][finite] - expected) <
+                0.05 * spread).all(), column
+
+    # An aperture with no finite pixels has no statistics at all
+    empty = stats[1]
+    assert empty['flux_count'] == 0
+    for column in ['flux_mean', 'flux_rms', 'flux_min', 'flux_max',
+                   'flux_q10', 'flux_median', 'flux_q90']:
+        assert np.isnan(empty[column]), column
+
+
+@pytest.mark.skipif(not os.path.isfile(TEST_FILENAME),
+        reason="cannot find test source file")
+def test_index_nights_cover_imagelist():
+    tmid = fits.getdata(TEST_FILENAME, 'imagelist')['tmid']
+    index = fits.getdata(TEST_FILENAME, 'index')
+    nights = index[index['type'] == 'NIGHT']
+
+    assert nights['start'][0] == 0
+    assert nights['stop'][-1] == len(tmid)
+    assert (nights['start'][1:] == nights['stop'][:-1]).all()
+    assert (nights['mjd_min'] == tmid[nights['start']]).all()
@@ -0,0 +1,294 @@
+import json
+import subprocess
+import sys
+
+import numpy as np
+from astropy.io import fits
+import pytest
+
+sys.path.insert(0, 'testing')
+from stitch_helpers import (BINARY, has_backend, needs_binary, write_source,
+                            stitch)
+
+NAPERTURES = 3
+
+
+def flux_for(tmid):
+    '''
+    FLUX that identifies its epoch and aperture: aperture * 1000 + TMID
+    '''
+    return (np.arange(NAPERTURES)[:, np.newaxis] * 1000. +
+            np.asarray(tmid)[np.newaxis, :])
+
+
+@needs_binary
+@pytest.mark.parametrize('backend', [
+    'cfitsio', 'mmap', 'pread',
+    pytest.param('uring', marks=pytest.mark.skipif(
+        not has_backend('uring'), reason="built without liburing")),
+])
+def test_interleaved_inputs_are_merged_by_tmid(tmpdir, backend):
+    '''
+    Two files taken over the same night interleave epoch by epoch; a third,
+    also overlapping, is not in TMID order
+    '''
+    inputs = [np.arange(0., 40., 2.) + 0.5,
+              np.arange(1., 41., 2.) + 0.5,
+              np.array([7.25, 3.25, 11.25, 5.25])]
+    files = []
+    for i, tmid in enumerate(inputs):
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        write_source(files[-1], tmid, {'FLUX': flux_for(tmid)})
+    output = str(tmpdir.join('out.fits'))
+
+    stitch(files, output, '--io-backend', backend)
+
+    expected = np.sort(np.concatenate(inputs))
+    with fits.open(output) as infile:
+        tmid = infile['IMAGELIST'].data['TMID']
+        hjd = infile['HJD'].data
+        flux = infile['FLUX'].data
+
+    assert np.array_equal(tmid, expected)
+    assert np.array_equal(hjd, np.tile(expected, (NAPERTURES, 1)))
+    assert np.array_equal(flux, flux_for(expected))
+
+
+@pytest.fixture
+def partly_matching(tmpdir):
+    '''
+    Two nights whose OBJ_ID sets only partly overlap, with FLUX of
+    source row * 1000 + TMID
+    '''
+    nights = [(np.arange(5.) + 0.5, ['A', 'B', 'C', 'D']),
+              (np.arange(5.) + 10.5, ['C', 'E', 'A'])]
+    files = []
+    for i, (tmid, obj_ids) in enumerate(nights):
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        flux = (np.arange(len(obj_ids))[:, np.newaxis] * 1000. +
+                tmid[np.newaxis, :])
+        write_source(files[-1], tmid, {'FLUX': flux}, obj_ids=obj_ids)
+    return files, nights
+
+
+def expected_flux(nights, obj_ids):
+    columns = []
+    for tmid, night_ids in nights:
+        column = np.full((len(obj_ids), tmid.size), np.nan)
+        for i, obj_id in enumerate(obj_ids):
+            if obj_id in night_ids:
+                column[i] = night_ids.index(obj_id) * 1000. + tmid
+        columns.append(column)
+    return np.hstack(columns)
+
+
+def read_output(output):
+    with fits.open(output) as infile:
+        catalogue = infile['CATALOGUE'].data
+        return (list(catalogue['OBJ_ID']), catalogue['FLUX_MEAN'],
+                infile['FLUX'].data)
+
+
+@needs_binary
+def test_union_of_apertures(tmpdir, partly_matching):
+    files, nights = partly_matching
+    output = str(tmpdir.join('out.fits'))
+    stitch(files, output, '--match-apertures', 'union')
+
+    obj_ids, flux_mean, flux = read_output(output)
+    assert obj_ids == ['A', 'B', 'C', 'D', 'E']
+    # CATALOGUE rows come from the first file to have the aperture
+    assert np.array_equal(flux_mean, [0., 1., 2., 3., 1.])
+    expected = expected_flux(nights, obj_ids)
+    assert np.isnan(flux[[1, 3], 5:]).all()
+    assert np.isnan(flux[4, :5]).all()
+    np.testing.assert_array_equal(flux, expected)
+
+
+@needs_binary
+def test_intersection_of_apertures(tmpdir, partly_matching):
+    files, nights = partly_matching
+    output = str(tmpdir.join('out.fits'))
+    stitch(files, output, '--match-apertures', 'intersection')
+
+    obj_ids, flux_mean, flux = read_output(output)
+    assert obj_ids == ['A', 'C']
+    assert np.array_equal(flux_mean, [0., 2.])
+    np.testing.assert_array_equal(flux, expected_flux(nights, obj_ids))
+
+
+@needs_binary
+def test_metrics_written_for_failed_run(tmpdir):
+    metrics_file = str(tmpdir.join('metrics.json'))
+    command = [BINARY, str(tmpdir.join('missing.fits')), '-o',
+               str(tmpdir.join('out.fits')), '--metrics-json', metrics_file]
+    assert subprocess.call(command) == 1
+
+    with open(metrics_file) as infile:
+        metrics = json.load(infile)
+    assert metrics['status'] == 1
+    assert 'missing.fits' in metrics['error']
+    assert 'wall_seconds' in metrics
+
+
+def assert_same_hdus(expected, actual):
+    with fits.open(expected) as a, fits.open(actual) as b:
+        assert [hdu.name for hdu in a] == [hdu.name for hdu in b]
+        for hdu in a[1:]:
+            other = b[hdu.name]
+            if isinstance(hdu, fits.BinTableHDU):
+                assert hdu.columns.names == other.columns.names
+                for name in hdu.columns.names:
+                    np.testing.assert_array_equal(hdu.data[name],
+                                                  other.data[name])
+            else:
+                np.testing.assert_array_equal(hdu.data, other.data)
+
+
+@pytest.fixture
+def sharded_nights(tmpdir):
+    rng = np.random.RandomState(3)
+    files = []
+    for i, start in enumerate([0.5, 10.5]):
+        tmid = np.arange(start, start + 6.)
+        flux = rng.normal(1000., 10., (7, tmid.size))
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        write_source(files[-1], tmid, {'FLUX': flux})
+    return files
+
+
+def write_shards(tmpdir, files, nshards, *extra):
+    shards = []
+    for i in range(nshards):
+        shards.append(str(tmpdir.join('shard{}.fits'.format(i))))
+        stitch(files, shards[-1], '--shard', '{}/{}'.format(i, nshards),
+               '--stats', 'FLUX', *extra)
+    return shards
+
+
+@needs_binary
+def test_merged_shards_match_unsharded_output(tmpdir, sharded_nights):
+    full = str(tmpdir.join('full.fits'))
+    stitch(sharded_nights, full, '--stats', 'FLUX')
+    shards = write_shards(tmpdir, sharded_nights, 3)
+    merged = str(tmpdir.join('merged.fits'))
+    stitch(shards, merged, '--merge-shards')
+
+    assert_same_hdus(full, merged)
+
+
+def merge_error(shards, output):
+    child = subprocess.Popen([BINARY] + shards +
+                             ['-o', output, '--merge-shards'],
+                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    log = child.communicate()[0].decode('utf-8', 'replace')
+    assert child.returncode == 1
+    return log
+
+
+@needs_binary
+def test_merge_rejects_shards_of_different_splits(tmpdir, sharded_nights):
+    halves = write_shards(tmpdir, sharded_nights, 2)
+    thirds = write_shards(tmpdir.mkdir('thirds'), sharded_nights, 3)
+    output = str(tmpdir.join('merged.fits'))
+
+    log = merge_error([halves[0], thirds[1]], output)
+    assert 'is shard 1/3, expected 1/2' in log
+    log = merge_error(halves[:1], output)
+    assert 'is shard 0/2, expected 0/1' in log
+
+
+@needs_binary
+def test_merge_rejects_shards_of_different_epochs(tmpdir, sharded_nights):
+    shards = write_shards(tmpdir, sharded_nights, 2)
+    # Same number of epochs, one of them at a different time
+    moved = str(tmpdir.join('moved.fits'))
+    with fits.open(sharded_nights[1]) as infile:
+        tmid = infile['IMAGELIST'].data['TMID'].copy()
+        flux = infile['FLUX'].data
+    tmid[-1] += 0.25
+    write_source(moved, tmid, {'FLUX': flux})
+    stitch([sharded_nights[0], moved], shards[1], '--shard', '1/2', '--stats',
+           'FLUX')
+
+    log = merge_error(shards, str(tmpdir.join('merged.fits')))
+    assert 'covers different epochs' in log
+
+
+@needs_binary
+def test_frame_filter(tmpdir):
+    tmid = np.arange(8.) + 0.5
+    source = str(tmpdir.join('night.fits'))
+    write_source(source, tmid, {'FLUX': flux_for(tmid)})
+    output = str(tmpdir.join('out.fits'))
+    stitch([source], output, '--filter', 'IMAGE_ID % 3 != 1')
+
+    kept = np.array([0, 2, 3, 5, 6])
+    with fits.open(output) as infile:
+        assert list(infile['IMAGELIST'].data['IMAGE_ID']) == list(kept)
+        np.testing.assert_array_equal(infile['IMAGELIST'].data['TMID'],
+                                      tmid[kept])
+        np.testing.assert_array_equal(infile['FLUX'].data,
+                                      flux_for(tmid[kept]))
+
+
+@needs_binary
+def test_mjd_window(tmpdir):
+    '''
+    The first night lies outside the window, the second straddles its
+    start and the third spans its end with no frame inside it
+    '''
+    nights = [np.arange(6.) + 0.5, np.arange(6.) + 10.5,
+              np.array([20.5, 30.5])]
+    files = []
+    for i, tmid in enumerate(nights):
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        write_source(files[-1], tmid, {'FLUX': flux_for(tmid)})
+    output = str(tmpdir.join('out.fits'))
+    log = stitch(files, output, '--mjd-min', '12', '--mjd-max', '25')
+
+    assert 'Skipping 1 files outside the MJD window' in log
+    assert 'Skipping 1 files with no frames to copy' in log
+    expected = nights[1][2:]
+    with fits.open(output) as infile:
+        np.testing.assert_array_equal(infile['IMAGELIST'].data['TMID'],
+                                      expected)
+        np.testing.assert_array_equal(infile['FLUX'].data,
+                                      flux_for(expected))
+        index = infile['INDEX'].data
+        names = index['NAME'][index['TYPE'] == 'FILE']
+    assert list(names) == [files[1]]
+
+
+@needs_binary
+@pytest.mark.parametrize('backend', ['cfitsio', 'mmap'])
+def test_native_pixel_types(tmpdir, backend):
+    '''
+    Each image keeps its pixel type, unsigned integers included, and its
+    values exactly
+    '''
+    dtypes = {'FLUX': np.float32, 'CCDX': np.int32, 'QUALITY': np.int16,
+              'COUNTS': np.uint16}
+    nights = [np.arange(4.) + 0.5, np.arange(4.) + 10.5]
+    files, expected = [], {name: [] for name in dtypes}
+    for i, tmid in enumerate(nights):
+        images = {}
+        for name, dtype in dtypes.items():
+            if dtype == np.float32:
+                data = np.arange(NAPERTURES * tmid.size) / 3. + i
+            else:
+                info = np.iinfo(dtype)
+                data = np.linspace(info.min, info.max,
+                                   NAPERTURES * tmid.size) // (i + 1)
+            images[name] = data.reshape(NAPERTURES, -1).astype(dtype)
+            expected[name].append(images[name])
+        files.append(str(tmpdir.join('night{}.fits'.format(i))))
+        write_source(files[-1], tmid, images)
+    output = str(tmpdir.join('out.fits'))
+    stitch(files, output, '--io-backend', backend)
+
+    with fits.open(output) as infile:
+        for name, dtype in dtypes.items():
+            data = infile[name].data
+            assert data.dtype.newbyteorder('=') == np.dtype(dtype)
+            np.testing.assert_array_equal(data, np.hstack(expected[name]))